@@ -2,11 +2,64 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <memory>
 #include <stdexcept>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <typeinfo>
+#include <cmath>
+#include <ctime>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <type_traits>
+#include <string_view>
+
+#ifdef __linux__
+#include <csignal>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <unistd.h>
+#endif
+
+#if !defined(PARSER_NO_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#define PARSER_HAS_CXXABI 1
+#endif
 
 // Token types
-enum class TokenType
+enum class TokenType : uint8_t
 {
 	NUMBER,
 	IDENTIFIER,
@@ -21,427 +74,9237 @@ enum class TokenType
 	ENDIF,
 	LPAREN,
 	RPAREN,
-	END
+	END,
+	INVALID // a character that cannot start a token; only Scanner yields it
 };
 
 // Token structure
+// Twelve bytes: the text stays in the lexer's input and is found by offset
+// and length, and a number literal that fits in an int carries its value.
+// Positions are not stored; the lexer reports the latest token's.
 struct Token
 {
-	TokenType type;
-	std::string value;
-	int line;
-	int column;
+	enum Flags : uint8_t
+	{
+		HAS_VALUE = 1, // value holds the number literal
+		LONG = 2	   // text is longer than length can hold
+	};
+
+	TokenType type = TokenType::END;
+	uint8_t flags = 0;
+	uint16_t length = 0;
+	uint32_t offset = 0;
+	int32_t value = 0;
 };
 
-// AST Node structure
-class ASTNode
+static_assert(sizeof(Token) == 12, "Token should stay packed");
+
+// Source position of a token's first character
+struct Position
 {
-public:
-	virtual ~ASTNode() = default;
-	virtual int evaluate() = 0;
+	int line;
+	int column;
 };
 
-// Number Node
-class NumberNode : public ASTNode
+// Phase timers and counters
+// Enabled at runtime with stats::enable(); building with -DPARSER_NO_STATS
+// turns every hook into an empty inline function. Each thread accumulates
+// into its own record, which is folded into a global total when the thread
+// exits, so the hooks never contend.
+namespace stats
 {
-private:
-	int value;
+	enum Phase
+	{
+		LEX,
+		PARSE,
+		COMPILE,
+		EVALUATE,
+		phaseCount
+	};
 
-public:
-	NumberNode(int val) : value(val) {}
-	int evaluate() override { return value; }
-};
+	enum Counter
+	{
+		TOKENS,
+		NODES_CREATED,
+		NODES_EVALUATED,
+		counterCount
+	};
 
-// Variable Node
-class VariableNode : public ASTNode
-{
-private:
-	std::string name;
-	static std::map<std::string, int> variables;
+	inline const char *phaseName(Phase phase)
+	{
+		static const char *const names[] = {"lex", "parse", "compile", "evaluate"};
+		return names[phase];
+	}
 
-public:
-	VariableNode(const std::string &varName) : name(varName) {}
-	int evaluate() override
+	inline const char *counterName(Counter counter)
 	{
-		if (variables.find(name) == variables.end())
-		{
-			throw std::runtime_error("Undefined variable: " + name);
-		}
-		return variables[name];
+		static const char *const names[] = {"tokens", "nodes created", "nodes evaluated"};
+		return names[counter];
 	}
-	static void setVariable(const std::string &name, int value)
+
+	struct Totals
+	{
+		uint64_t calls[phaseCount] = {};
+		uint64_t ticks[phaseCount] = {};
+		uint64_t counters[counterCount] = {};
+	};
+
+#ifndef PARSER_NO_STATS
+	inline uint64_t timestamp()
 	{
-		variables[name] = value;
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+										 std::chrono::steady_clock::now().time_since_epoch())
+										 .count());
+#endif
 	}
-};
 
-std::map<std::string, int> VariableNode::variables;
+	// Only the owning thread writes, so relaxed load+store is enough.
+	struct ThreadRecord
+	{
+		std::atomic<uint64_t> calls[phaseCount] = {};
+		std::atomic<uint64_t> ticks[phaseCount] = {};
+		std::atomic<uint64_t> counters[counterCount] = {};
 
-// Binary Operation Node
-class BinaryOpNode : public ASTNode
-{
-private:
-	std::shared_ptr<ASTNode> left;
-	std::shared_ptr<ASTNode> right;
-	TokenType op;
+		ThreadRecord();
+		~ThreadRecord();
 
-public:
-	BinaryOpNode(std::shared_ptr<ASTNode> l, TokenType operation, std::shared_ptr<ASTNode> r)
-		: left(l), op(operation), right(r) {}
+		static void bump(std::atomic<uint64_t> &value, uint64_t by)
+		{
+			value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+		}
 
-	int evaluate() override
+		void addTo(Totals &totals) const
+		{
+			for (int p = 0; p < phaseCount; p++)
+			{
+				totals.calls[p] += calls[p].load(std::memory_order_relaxed);
+				totals.ticks[p] += ticks[p].load(std::memory_order_relaxed);
+			}
+			for (int c = 0; c < counterCount; c++)
+			{
+				totals.counters[c] += counters[c].load(std::memory_order_relaxed);
+			}
+		}
+	};
+
+	struct Registry
 	{
-		int leftVal = left->evaluate();
-		int rightVal = right->evaluate();
+		std::mutex mutex;
+		std::vector<ThreadRecord *> live;
+		Totals retired;
+		std::atomic<bool> enabled{false};
+		// Taken together at startup, to calibrate timestamps against.
+		uint64_t startTicks = timestamp();
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
 
-		switch (op)
+		static Registry &instance()
 		{
-		case TokenType::PLUS:
-			return leftVal + rightVal;
-		case TokenType::MINUS:
-			return leftVal - rightVal;
-		case TokenType::MULTIPLY:
-			return leftVal * rightVal;
-		case TokenType::DIVIDE:
-			if (rightVal == 0)
-				throw std::runtime_error("Division by zero");
-			return leftVal / rightVal;
-		default:
-			throw std::runtime_error("Invalid operator");
+			static Registry registry;
+			return registry;
 		}
-	}
-};
-
-// Assignment Node
-class AssignmentNode : public ASTNode
-{
-private:
-	std::string name;
-	std::shared_ptr<ASTNode> value;
+	};
 
-public:
-	AssignmentNode(const std::string &varName, std::shared_ptr<ASTNode> val)
-		: name(varName), value(val) {}
+	// Built before main, so calibration spans the whole run.
+	static Registry &startup = Registry::instance();
 
-	int evaluate() override
+	inline ThreadRecord::ThreadRecord()
 	{
-		int val = value->evaluate();
-		VariableNode::setVariable(name, val);
-		return val;
+		Registry &registry = Registry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.live.push_back(this);
 	}
-};
-
-// If Node
-class IfNode : public ASTNode
-{
-private:
-	std::shared_ptr<ASTNode> condition;
-	std::shared_ptr<ASTNode> thenBranch;
-	std::shared_ptr<ASTNode> elseBranch;
 
-public:
-	IfNode(std::shared_ptr<ASTNode> cond, std::shared_ptr<ASTNode> then, std::shared_ptr<ASTNode> else_)
-		: condition(cond), thenBranch(then), elseBranch(else_) {}
+	inline ThreadRecord::~ThreadRecord()
+	{
+		Registry &registry = Registry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		addTo(registry.retired);
+		registry.live.erase(std::find(registry.live.begin(), registry.live.end(), this));
+	}
 
-	int evaluate() override
+	inline ThreadRecord &record()
 	{
-		if (condition->evaluate() != 0)
-		{
-			return thenBranch->evaluate();
-		}
-		else if (elseBranch)
-		{
-			return elseBranch->evaluate();
-		}
-		return 0;
+		thread_local ThreadRecord threadRecord;
+		return threadRecord;
 	}
-};
 
-// Lexer class
-class Lexer
-{
-private:
-	std::string input;
-	size_t position;
-	int line;
-	int column;
+	inline bool enabled()
+	{
+		return Registry::instance().enabled.load(std::memory_order_relaxed);
+	}
 
-	char current() const
+	inline void enable()
 	{
-		return position < input.length() ? input[position] : '\0';
+		Registry::instance().enabled.store(true, std::memory_order_relaxed);
 	}
 
-	void advance()
+	inline void count(Counter counter, uint64_t by = 1)
 	{
-		if (current() == '\n')
+		if (enabled())
 		{
-			line++;
-			column = 1;
+			ThreadRecord::bump(record().counters[counter], by);
 		}
-		else
+	}
+
+	// Times the enclosing scope into one phase. Phases nest: parse time
+	// includes the lexing it drives.
+	class PhaseScope
+	{
+	private:
+		Phase phase;
+		uint64_t start;
+
+	public:
+		PhaseScope(Phase p) : phase(p), start(enabled() ? timestamp() : 0) {}
+		~PhaseScope()
 		{
-			column++;
+			if (start != 0)
+			{
+				ThreadRecord &r = record();
+				ThreadRecord::bump(r.calls[phase], 1);
+				ThreadRecord::bump(r.ticks[phase], timestamp() - start);
+			}
 		}
-		position++;
-	}
+		PhaseScope(const PhaseScope &) = delete;
+		PhaseScope &operator=(const PhaseScope &) = delete;
+	};
 
-	void skipWhitespace()
+	inline Totals snapshot()
 	{
-		while (isspace(current()))
+		Registry &registry = Registry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		Totals totals = registry.retired;
+		for (ThreadRecord *r : registry.live)
 		{
-			advance();
+			r->addTo(totals);
 		}
+		return totals;
 	}
 
-	Token number()
+	// Timestamp ticks per nanosecond, measured once, on first use, against
+	// the steady clock over the time since startup.
+	inline double ticksPerNanosecond()
 	{
-		std::string result;
-		while (isdigit(current()))
+#if defined(__x86_64__) || defined(__i386__)
+		static const double rate = []
 		{
-			result += current();
-			advance();
-		}
-		return {TokenType::NUMBER, result, line, column};
+			uint64_t ticks = timestamp() - startup.startTicks;
+			double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startup.startTime).count();
+			return ns > 0 ? ticks / ns : 1.0;
+		}();
+		return rate;
+#else
+		return 1.0;
+#endif
 	}
 
-	Token identifier()
+	inline void report(std::ostream &out)
 	{
-		std::string result;
-		while (isalnum(current()) || current() == '_')
+		Totals totals = snapshot();
+		double rate = ticksPerNanosecond();
+
+		out << "phase          calls     total(us)     avg(ns)\n";
+		for (int p = 0; p < phaseCount; p++)
 		{
-			result += current();
-			advance();
+			double ns = totals.ticks[p] / rate;
+			out << std::left << std::setw(10) << phaseName(static_cast<Phase>(p)) << std::right
+				<< std::setw(10) << totals.calls[p]
+				<< std::setw(14) << std::fixed << std::setprecision(1) << ns / 1000.0
+				<< std::setw(12) << std::setprecision(1) << (totals.calls[p] ? ns / totals.calls[p] : 0.0)
+				<< "\n";
+		}
+		for (int c = 0; c < counterCount; c++)
+		{
+			out << counterName(static_cast<Counter>(c)) << ": " << totals.counters[c] << "\n";
 		}
+		out.unsetf(std::ios::floatfield);
+	}
+#else
+	inline bool enabled() { return false; }
+	inline void enable() {}
+	inline void count(Counter, uint64_t = 1) {}
 
-		if (result == "if")
-			return {TokenType::IF, result, line, column};
-		if (result == "then")
-			return {TokenType::THEN, result, line, column};
-		if (result == "else")
-			return {TokenType::ELSE, result, line, column};
-		if (result == "endif")
-			return {TokenType::ENDIF, result, line, column};
+	class PhaseScope
+	{
+	public:
+		PhaseScope(Phase) {}
+	};
+
+	inline Totals snapshot() { return Totals(); }
 
-		return {TokenType::IDENTIFIER, result, line, column};
+	inline void report(std::ostream &out)
+	{
+		out << "statistics were compiled out (PARSER_NO_STATS)\n";
 	}
+#endif
+}
 
-public:
-	Lexer(const std::string &text) : input(text), position(0), line(1), column(1) {}
+// Allocation accounting by phase and node type
+// Building with -DPARSER_ALLOC_TRACKING replaces the global operator new and
+// delete; every block is then prefixed with a small header recording its
+// size, the phase it was allocated in and the AST node type under
+// construction, so frees are charged back to the right bucket and live and
+// peak bytes are exact. Other builds keep the system allocator and report
+// nothing.
+namespace alloc
+{
+	constexpr int other = stats::phaseCount;
+	constexpr int phaseSlots = stats::phaseCount + 1;
+	constexpr int maxNodeTypes = 32;
 
-	Token nextToken()
+	struct Bucket
 	{
-		skipWhitespace();
+		std::atomic<uint64_t> allocations{0};
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<int64_t> live{0};
+		std::atomic<int64_t> peak{0};
 
-		if (position >= input.length())
+		void add(size_t size)
 		{
-			return {TokenType::END, "", line, column};
+			allocations.fetch_add(1, std::memory_order_relaxed);
+			bytes.fetch_add(size, std::memory_order_relaxed);
+			int64_t now = live.fetch_add(static_cast<int64_t>(size), std::memory_order_relaxed) +
+						  static_cast<int64_t>(size);
+			int64_t high = peak.load(std::memory_order_relaxed);
+			while (now > high && !peak.compare_exchange_weak(high, now, std::memory_order_relaxed))
+			{
+			}
 		}
 
-		char c = current();
-
-		if (isdigit(c))
+		void remove(size_t size)
 		{
-			return number();
+			live.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
 		}
 
-		if (isalpha(c))
-		{
-			return identifier();
-		}
+		// Starts a new high-water mark from the current live size.
+		void resetPeak() { peak.store(live.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+	};
 
-		advance();
+	struct State
+	{
+		std::atomic<bool> enabled{false};
+		Bucket total;
+		Bucket phases[phaseSlots];
+		Bucket nodes[maxNodeTypes];
+		std::atomic<const char *> nodeNames[maxNodeTypes] = {};
+	};
 
-		switch (c)
-		{
-		case '+':
-			return {TokenType::PLUS, "+", line, column};
-		case '-':
-			return {TokenType::MINUS, "-", line, column};
-		case '*':
-			return {TokenType::MULTIPLY, "", line, column};
-		case '/':
-			return {TokenType::DIVIDE, "/", line, column};
-		case '=':
-			return {TokenType::ASSIGN, "=", line, column};
-		case '(':
-			return {TokenType::LPAREN, "(", line, column};
-		case ')':
-			return {TokenType::RPAREN, ")", line, column};
-		default:
-			throw std::runtime_error("Invalid character: " + std::string(1, c));
-		}
+	// Constant-initialized so it is usable from the very first allocation.
+	inline State &state()
+	{
+		static State instance;
+		return instance;
 	}
-};
 
-// Parser class
-class Parser
-{
-private:
-	Lexer lexer;
-	Token currentToken;
+	inline thread_local uint8_t currentPhase = other;
+	inline thread_local uint8_t currentNode = 0;
 
-	void eat(TokenType type)
+	inline bool enabled() { return state().enabled.load(std::memory_order_relaxed); }
+	inline void enable() { state().enabled.store(true, std::memory_order_relaxed); }
+
+	// Index of a node type name (1-based; 0 means none or table full).
+	inline uint8_t nodeIndex(const char *name)
 	{
-		if (currentToken.type == type)
-		{
-			currentToken = lexer.nextToken();
-		}
-		else
+		State &s = state();
+		for (int i = 1; i < maxNodeTypes; i++)
 		{
-			throw std::runtime_error("Unexpected token: " + currentToken.value);
+			const char *current = s.nodeNames[i].load(std::memory_order_acquire);
+			if (current == nullptr &&
+				s.nodeNames[i].compare_exchange_strong(current, name, std::memory_order_acq_rel))
+			{
+				return static_cast<uint8_t>(i);
+			}
+			if (current == name)
+			{
+				return static_cast<uint8_t>(i);
+			}
 		}
+		return 0;
 	}
 
-	std::shared_ptr<ASTNode> factor()
+	// Charges allocations in the enclosing scope to a phase.
+	class PhaseScope
 	{
-		Token token = currentToken;
+	private:
+		uint8_t previous;
 
-		if (token.type == TokenType::NUMBER)
-		{
-			eat(TokenType::NUMBER);
-			return std::make_shared<NumberNode>(std::stoi(token.value));
-		}
+	public:
+		PhaseScope(stats::Phase phase) : previous(currentPhase) { currentPhase = static_cast<uint8_t>(phase); }
+		~PhaseScope() { currentPhase = previous; }
+		PhaseScope(const PhaseScope &) = delete;
+		PhaseScope &operator=(const PhaseScope &) = delete;
+	};
 
-		if (token.type == TokenType::IDENTIFIER)
-		{
-			std::string name = token.value;
-			eat(TokenType::IDENTIFIER);
-			return std::make_shared<VariableNode>(name);
-		}
+	// Charges allocations in the enclosing scope to an AST node type.
+	class NodeScope
+	{
+	private:
+		uint8_t previous;
 
-		if (token.type == TokenType::LPAREN)
+	public:
+		NodeScope(const std::type_info &type) : previous(currentNode)
 		{
-			eat(TokenType::LPAREN);
-			auto node = expr();
-			eat(TokenType::RPAREN);
-			return node;
+			currentNode = enabled() ? nodeIndex(type.name()) : 0;
 		}
+		NodeScope(std::nullptr_t) : previous(currentNode) { currentNode = 0; }
+		~NodeScope() { currentNode = previous; }
+		NodeScope(const NodeScope &) = delete;
+		NodeScope &operator=(const NodeScope &) = delete;
+	};
 
-		throw std::runtime_error("Invalid factor");
-	}
-
-	std::shared_ptr<ASTNode> term()
+	struct alignas(16) Header
 	{
-		auto node = factor();
+		size_t size;
+		uint8_t phase;
+		uint8_t node;
+		bool tracked;
+		uint32_t offset; // from the start of the malloc block to the header
+	};
 
-		while (currentToken.type == TokenType::MULTIPLY ||
-			   currentToken.type == TokenType::DIVIDE)
+	static_assert(sizeof(Header) == 16, "header must preserve malloc alignment");
+
+	// Alignments up to the header's come straight from malloc; larger ones
+	// over-allocate and place the header just below the aligned block.
+	inline void *allocate(size_t size, size_t alignment = alignof(Header))
+	{
+		size_t slack = alignment > alignof(Header) ? alignment : 0;
+		if (size > SIZE_MAX - sizeof(Header) - slack)
 		{
-			Token token = currentToken;
-			if (token.type == TokenType::MULTIPLY)
-			{
-				eat(TokenType::MULTIPLY);
-			}
-			else
+			return nullptr;
+		}
+		char *block = static_cast<char *>(std::malloc(sizeof(Header) + slack + size));
+		if (block == nullptr)
+		{
+			return nullptr;
+		}
+		uintptr_t user = reinterpret_cast<uintptr_t>(block) + sizeof(Header);
+		if (slack != 0)
+		{
+			user = (user + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+		}
+		Header *header = reinterpret_cast<Header *>(user) - 1;
+		header->offset = static_cast<uint32_t>(reinterpret_cast<char *>(header) - block);
+		header->size = size;
+		header->phase = currentPhase;
+		header->node = currentNode;
+		header->tracked = enabled();
+		if (header->tracked)
+		{
+			State &s = state();
+			s.total.add(size);
+			s.phases[header->phase].add(size);
+			if (header->node != 0)
 			{
-				eat(TokenType::DIVIDE);
+				s.nodes[header->node].add(size);
 			}
-			node = std::make_shared<BinaryOpNode>(node, token.type, factor());
 		}
-
-		return node;
+		return header + 1;
 	}
 
-	std::shared_ptr<ASTNode> expr()
+	inline void release(void *pointer)
 	{
-		auto node = term();
-
-		while (currentToken.type == TokenType::PLUS ||
-			   currentToken.type == TokenType::MINUS)
+		if (pointer == nullptr)
 		{
-			Token token = currentToken;
-			if (token.type == TokenType::PLUS)
-			{
-				eat(TokenType::PLUS);
-			}
-			else
+			return;
+		}
+		Header *header = static_cast<Header *>(pointer) - 1;
+		if (header->tracked)
+		{
+			State &s = state();
+			s.total.remove(header->size);
+			s.phases[header->phase].remove(header->size);
+			if (header->node != 0)
 			{
-				eat(TokenType::MINUS);
+				s.nodes[header->node].remove(header->size);
 			}
-			node = std::make_shared<BinaryOpNode>(node, token.type, term());
 		}
-
-		return node;
+		std::free(reinterpret_cast<char *>(header) - header->offset);
 	}
 
-	std::shared_ptr<ASTNode> statement()
+	inline std::string demangle(const char *name)
 	{
-		if (currentToken.type == TokenType::IF)
+#ifdef PARSER_HAS_CXXABI
+		int status = 0;
+		char *readable = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+		if (status == 0 && readable != nullptr)
 		{
-			return ifStatement();
+			std::string result(readable);
+			std::free(readable);
+			return result;
 		}
+#endif
+		return name;
+	}
 
-		if (currentToken.type == TokenType::IDENTIFIER)
+	inline void report(std::ostream &out)
+	{
+#ifndef PARSER_ALLOC_TRACKING
+		out << "allocation tracking is not compiled in (build with -DPARSER_ALLOC_TRACKING)\n";
+#else
+		State &s = state();
+		auto row = [&out](const std::string &name, const Bucket &b)
 		{
-			std::string name = currentToken.value;
-			eat(TokenType::IDENTIFIER);
+			out << std::left << std::setw(16) << name << std::right
+				<< std::setw(10) << b.allocations.load()
+				<< std::setw(12) << b.bytes.load()
+				<< std::setw(12) << b.live.load()
+				<< std::setw(12) << b.peak.load() << "\n";
+		};
 
-			if (currentToken.type == TokenType::ASSIGN)
+		out << "phase              allocs       bytes        live   peak live\n";
+		for (int p = 0; p < stats::phaseCount; p++)
+		{
+			row(stats::phaseName(static_cast<stats::Phase>(p)), s.phases[p]);
+		}
+		row("other", s.phases[other]);
+		row("total", s.total);
+
+		out << "node type          allocs       bytes        live   peak live\n";
+		for (int i = 1; i < maxNodeTypes; i++)
+		{
+			if (const char *name = s.nodeNames[i].load())
 			{
-				eat(TokenType::ASSIGN);
-				auto value = expr();
-				return std::make_shared<AssignmentNode>(name, value);
+				row(demangle(name), s.nodes[i]);
 			}
-
-			return std::make_shared<VariableNode>(name);
 		}
-
-		return expr();
+#endif
 	}
+}
 
-	std::shared_ptr<ASTNode> ifStatement()
+#ifdef PARSER_ALLOC_TRACKING
+void *operator new(size_t size)
+{
+	if (void *pointer = alloc::allocate(size))
 	{
-		eat(TokenType::IF);
-		auto condition = expr();
-		eat(TokenType::THEN);
-		auto thenBranch = statement();
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	return alloc::allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return alloc::allocate(size);
+}
+
+void operator delete(void *pointer) noexcept { alloc::release(pointer); }
+void operator delete[](void *pointer) noexcept { alloc::release(pointer); }
+void operator delete(void *pointer, size_t) noexcept { alloc::release(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { alloc::release(pointer); }
+void operator delete(void *pointer, const std::nothrow_t &) noexcept { alloc::release(pointer); }
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept { alloc::release(pointer); }
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	if (void *pointer = alloc::allocate(size, static_cast<size_t>(alignment)))
+	{
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return alloc::allocate(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return alloc::allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept { alloc::release(pointer); }
+void operator delete[](void *pointer, std::align_val_t) noexcept { alloc::release(pointer); }
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept { alloc::release(pointer); }
+void operator delete[](void *pointer, size_t, std::align_val_t) noexcept { alloc::release(pointer); }
+void operator delete(void *pointer, std::align_val_t, const std::nothrow_t &) noexcept { alloc::release(pointer); }
+void operator delete[](void *pointer, std::align_val_t, const std::nothrow_t &) noexcept { alloc::release(pointer); }
+#endif
+
+// Syntax errors from the lexer or parser
+class ParseError : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Reference to a variable with no value
+class UndefinedVariableError : public std::runtime_error
+{
+public:
+	UndefinedVariableError(const std::string &name) : std::runtime_error("Undefined variable: " + name) {}
+};
+
+// Integer division by zero
+class DivisionByZeroError : public std::runtime_error
+{
+public:
+	DivisionByZeroError() : std::runtime_error("Division by zero") {}
+};
+
+// Evaluation aborted because it ran out of budget
+class BudgetExceeded : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+// Per-request evaluation budget
+// Every evaluated node is charged against a countdown; only when it runs out
+// (at most every checkInterval nodes) is the node limit checked and the clock
+// read, so the cost on the hot path is one decrement and branch.
+class EvalBudget
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr uint64_t checkInterval = 256;
+	static constexpr uint64_t unlimited = UINT64_MAX - 1;
+
+	// Installs a budget on the current thread for the lifetime of the scope.
+	class Scope
+	{
+	private:
+		EvalBudget *previous;
+
+	public:
+		Scope(EvalBudget &budget) : previous(active) { active = &budget; }
+		~Scope() { active = previous; }
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+	};
+
+	EvalBudget(uint64_t maxNodes, Clock::time_point deadline = Clock::time_point::max())
+		: maxNodes(maxNodes), deadline(deadline), consumed(0), batch(0), countdown(0)
+	{
+		refill();
+	}
+
+	static EvalBudget *current() { return active; }
+
+	uint64_t nodesUsed() const { return consumed + (batch - countdown); }
+
+	// Nodes that can be charged before the next limit and deadline check.
+	uint64_t untilCheck() const { return countdown; }
+
+	void charge()
+	{
+		if (--countdown == 0)
+		{
+			consumed += batch;
+			batch = 0;
+			if (consumed > maxNodes)
+			{
+				throw BudgetExceeded("Evaluation budget exceeded: more than " +
+									 std::to_string(maxNodes) + " nodes");
+			}
+			if (deadline != Clock::time_point::max() && Clock::now() >= deadline)
+			{
+				throw BudgetExceeded("Evaluation deadline exceeded");
+			}
+			refill();
+		}
+	}
+
+	// Charges units at once, for callers that count their own work.
+	void charge(uint64_t units)
+	{
+		while (units >= countdown)
+		{
+			units -= countdown;
+			countdown = 1;
+			charge();
+		}
+		countdown -= units;
+	}
+
+private:
+	static thread_local EvalBudget *active;
+
+	uint64_t maxNodes;
+	Clock::time_point deadline;
+	uint64_t consumed;
+	uint64_t batch;
+	uint64_t countdown;
+
+	void refill()
+	{
+		// consumed never exceeds maxNodes here; the +1 is only added once it
+		// cannot overflow, so maxNodes == UINT64_MAX still gets a full batch.
+		uint64_t remaining = maxNodes - consumed;
+		batch = remaining < checkInterval ? remaining + 1 : checkInterval;
+		countdown = batch;
+	}
+};
+
+thread_local EvalBudget *EvalBudget::active = nullptr;
+
+// Chrome trace-event recording
+// Spans are appended to a per-thread buffer with two clock reads and no
+// locking; buffers are only walked when the trace is written, producing the
+// JSON object format understood by chrome://tracing and Perfetto. A buffer
+// is a list of fixed-size chunks that are never moved, and each chunk
+// publishes its event count with a release store, so the writer can read a
+// running thread's events without stopping it.
+namespace trace
+{
+	struct Event
+	{
+		const char *name;
+		const char *argName;
+		int64_t argValue;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	struct ThreadBuffer;
+
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<ThreadBuffer *> live;
+		std::vector<std::pair<uint32_t, std::vector<Event>>> retired;
+		std::atomic<bool> enabled{false};
+		std::atomic<uint32_t> nextThreadId{1};
+		std::chrono::steady_clock::time_point origin;
+
+		static Registry &instance()
+		{
+			static Registry registry;
+			return registry;
+		}
+	};
+
+	struct ThreadBuffer
+	{
+		struct Chunk
+		{
+			static constexpr size_t capacity = 4096;
+
+			Event events[capacity];
+			std::atomic<size_t> count{0};
+			std::atomic<Chunk *> next{nullptr};
+		};
+
+		uint32_t threadId;
+		Chunk *head;
+		Chunk *tail;
+
+		ThreadBuffer() : head(new Chunk()), tail(head)
+		{
+			Registry &registry = Registry::instance();
+			threadId = registry.nextThreadId.fetch_add(1);
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.live.push_back(this);
+		}
+
+		~ThreadBuffer()
+		{
+			Registry &registry = Registry::instance();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.retired.emplace_back(threadId, events());
+			registry.live.erase(std::find(registry.live.begin(), registry.live.end(), this));
+			while (head != nullptr)
+			{
+				Chunk *next = head->next.load(std::memory_order_relaxed);
+				delete head;
+				head = next;
+			}
+		}
+
+		// Owning thread only.
+		void append(const Event &event)
+		{
+			size_t count = tail->count.load(std::memory_order_relaxed);
+			if (count == Chunk::capacity)
+			{
+				Chunk *chunk = new Chunk();
+				tail->next.store(chunk, std::memory_order_release);
+				tail = chunk;
+				count = 0;
+			}
+			tail->events[count] = event;
+			tail->count.store(count + 1, std::memory_order_release);
+		}
+
+		// Any thread; sees every event published so far.
+		std::vector<Event> events() const
+		{
+			std::vector<Event> all;
+			for (const Chunk *chunk = head; chunk != nullptr; chunk = chunk->next.load(std::memory_order_acquire))
+			{
+				size_t count = chunk->count.load(std::memory_order_acquire);
+				all.insert(all.end(), chunk->events, chunk->events + count);
+			}
+			return all;
+		}
+	};
+
+	inline bool enabled()
+	{
+		return Registry::instance().enabled.load(std::memory_order_relaxed);
+	}
+
+	inline void enable()
+	{
+		Registry &registry = Registry::instance();
+		registry.origin = std::chrono::steady_clock::now();
+		registry.enabled.store(true, std::memory_order_relaxed);
+	}
+
+	inline uint64_t now()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+										 std::chrono::steady_clock::now() - Registry::instance().origin)
+										 .count());
+	}
+
+	// Records the enclosing scope as a complete ("X") event.
+	class Span
+	{
+	private:
+		const char *name;
+		const char *argName = nullptr;
+		int64_t argValue = 0;
+		uint64_t start;
+		bool active;
+
+	public:
+		Span(const char *spanName) : name(spanName), start(0), active(enabled())
+		{
+			if (active)
+			{
+				start = now();
+			}
+		}
+
+		~Span()
+		{
+			if (active)
+			{
+				uint64_t end = now();
+				thread_local ThreadBuffer buffer;
+				buffer.append({name, argName, argValue, start, end - start});
+			}
+		}
+
+		void arg(const char *key, int64_t value)
+		{
+			argName = key;
+			argValue = value;
+		}
+
+		Span(const Span &) = delete;
+		Span &operator=(const Span &) = delete;
+	};
+
+	inline void writeEvents(std::ostream &out, uint32_t threadId, const std::vector<Event> &events, bool &first)
+	{
+		for (const Event &e : events)
+		{
+			out << (first ? "\n" : ",\n");
+			first = false;
+			out << "{\"name\":\"" << e.name << "\",\"cat\":\"parser\",\"ph\":\"X\",\"pid\":1,\"tid\":" << threadId
+				<< ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << e.duration / 1000.0;
+			if (e.argName != nullptr)
+			{
+				out << ",\"args\":{\"" << e.argName << "\":" << e.argValue << "}";
+			}
+			out << "}";
+		}
+	}
+
+	inline bool write(const std::string &path)
+	{
+		std::ofstream out(path, std::ios::trunc);
+		out << std::fixed << std::setprecision(3);
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		bool first = true;
+		Registry &registry = Registry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (auto &retired : registry.retired)
+		{
+			writeEvents(out, retired.first, retired.second, first);
+		}
+		// Buffers leave live only under the mutex, so none is freed meanwhile.
+		for (ThreadBuffer *buffer : registry.live)
+		{
+			writeEvents(out, buffer->threadId, buffer->events(), first);
+		}
+		out << "\n]}\n";
+		return static_cast<bool>(out);
+	}
+}
+
+// Hardware performance counters
+// Opens cycles, instructions, branch-misses and cache-misses as one
+// perf_event_open group on the calling thread, so all four are read with a
+// single syscall and scaled together if the kernel multiplexes them. Phase
+// totals are attributed per token (lex, parse) and per evaluated node.
+// Unavailable off Linux or when perf_event_paranoid forbids user counters.
+class PerfCounters
+{
+public:
+	enum Event
+	{
+		CYCLES,
+		INSTRUCTIONS,
+		BRANCH_MISSES,
+		CACHE_MISSES,
+		eventCount
+	};
+
+	struct Sample
+	{
+		double values[eventCount] = {};
+	};
+
+	PerfCounters(bool enable = true)
+	{
+#ifdef __linux__
+		if (!enable)
+		{
+			return;
+		}
+		static const uint64_t configs[eventCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+													 PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+		for (int e = 0; e < eventCount; e++)
+		{
+			perf_event_attr attr = {};
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = configs[e];
+			attr.disabled = leader < 0 ? 1 : 0;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+			if (fd < 0)
+			{
+				if (leader < 0)
+				{
+					error = std::string("perf_event_open failed: ") + strerror(errno);
+					return;
+				}
+				continue;
+			}
+			if (leader < 0)
+			{
+				leader = fd;
+			}
+			fds.push_back(fd);
+			events.push_back(static_cast<Event>(e));
+		}
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+		(void)enable;
+		error = "hardware counters need Linux perf_event_open";
+#endif
+	}
+
+	~PerfCounters()
+	{
+#ifdef __linux__
+		for (int fd : fds)
+		{
+			close(fd);
+		}
+#endif
+	}
+
+	PerfCounters(const PerfCounters &) = delete;
+	PerfCounters &operator=(const PerfCounters &) = delete;
+
+	bool available() const { return leader >= 0; }
+	const std::string &unavailableReason() const { return error; }
+	bool has(Event e) const { return std::find(events.begin(), events.end(), e) != events.end(); }
+
+	Sample read() const
+	{
+		Sample sample;
+#ifdef __linux__
+		if (!available())
+		{
+			return sample;
+		}
+		uint64_t buffer[3 + eventCount] = {};
+		if (::read(leader, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(uint64_t)))
+		{
+			return sample;
+		}
+		double scale = buffer[2] != 0 ? static_cast<double>(buffer[1]) / buffer[2] : 1.0;
+		for (size_t i = 0; i < buffer[0] && i < events.size(); i++)
+		{
+			sample.values[events[i]] = buffer[3 + i] * scale;
+		}
+#endif
+		return sample;
+	}
+
+	// Adds everything counted since start to total.
+	void add(Sample &total, const Sample &start) const
+	{
+		Sample end = read();
+		for (int e = 0; e < eventCount; e++)
+		{
+			total.values[e] += end.values[e] - start.values[e];
+		}
+	}
+
+	// Adds everything counted since start to the phase's total.
+	void record(stats::Phase phase, const Sample &start) { add(totals[phase], start); }
+
+	// units[phase] is the number of tokens, instructions or nodes the phase processed.
+	void report(std::ostream &out, const uint64_t units[stats::phaseCount]) const
+	{
+		static const char *const unitNames[stats::phaseCount] = {"token", "token", "instr", "node"};
+
+		out << "phase         cycles  instructions    IPC  branch-miss  cache-miss   unit  miss/unit(br,cache)\n";
+		out << std::fixed;
+		for (int p = 0; p < stats::phaseCount; p++)
+		{
+			const Sample &t = totals[p];
+			double ipc = t.values[CYCLES] > 0 ? t.values[INSTRUCTIONS] / t.values[CYCLES] : 0.0;
+			double n = static_cast<double>(units[p]);
+			// Events the kernel would not open, and ratios without units, are n/a.
+			auto column = [&](Event e, int width, double divisor)
+			{
+				out << std::setw(width);
+				if (has(e) && divisor > 0)
+				{
+					out << t.values[e] / divisor;
+				}
+				else
+				{
+					out << "n/a";
+				}
+			};
+			out << std::left << std::setw(10) << stats::phaseName(static_cast<stats::Phase>(p)) << std::right
+				<< std::setprecision(0)
+				<< std::setw(10) << t.values[CYCLES]
+				<< std::setw(14) << t.values[INSTRUCTIONS]
+				<< std::setprecision(2) << std::setw(7) << ipc
+				<< std::setprecision(0);
+			column(BRANCH_MISSES, 13, 1.0);
+			column(CACHE_MISSES, 12, 1.0);
+			out << std::setw(7) << unitNames[p] << std::setprecision(3);
+			column(BRANCH_MISSES, 10, n);
+			column(CACHE_MISSES, 10, n);
+			out << "\n";
+		}
+		out.unsetf(std::ios::floatfield);
+	}
+
+private:
+	int leader = -1;
+	std::vector<int> fds;
+	std::vector<Event> events;
+	std::string error;
+	Sample totals[stats::phaseCount];
+};
+
+// Per-node evaluation hook: budget accounting and counters
+inline void countEvaluation()
+{
+	stats::count(stats::NODES_EVALUATED);
+	if (EvalBudget *budget = EvalBudget::current())
+	{
+		budget->charge();
+	}
+}
+
+// Result of one evaluation in a batch
+struct EvalOutcome
+{
+	bool ok = false;
+	int value = 0;
+	std::string error;
+};
+
+// Server-mode metrics in Prometheus text format
+// Each thread counts outcomes and records latencies into its own log-linear
+// histogram (8 sub-buckets per power of two, as in HdrHistogram); records are
+// only summed when scraped. Latency buckets are exposed at power-of-two
+// nanosecond boundaries, which line up exactly with the fine buckets.
+namespace metrics
+{
+	enum Outcome
+	{
+		OK,
+		PARSE_ERROR,
+		UNDEFINED_VARIABLE,
+		DIVISION_BY_ZERO,
+		BUDGET_EXCEEDED,
+		OTHER_ERROR,
+		outcomeCount
+	};
+
+	inline const char *outcomeName(Outcome outcome)
+	{
+		static const char *const names[] = {"ok", "parse_error", "undefined_variable",
+											"division_by_zero", "budget_exceeded", "other_error"};
+		return names[outcome];
+	}
+
+	// Literals past INT_MAX are rejected with std::stoi's out_of_range.
+	inline Outcome classify(const std::exception &e)
+	{
+		if (dynamic_cast<const ParseError *>(&e) || dynamic_cast<const std::out_of_range *>(&e))
+			return PARSE_ERROR;
+		if (dynamic_cast<const UndefinedVariableError *>(&e))
+			return UNDEFINED_VARIABLE;
+		if (dynamic_cast<const DivisionByZeroError *>(&e))
+			return DIVISION_BY_ZERO;
+		if (dynamic_cast<const BudgetExceeded *>(&e))
+			return BUDGET_EXCEEDED;
+		return OTHER_ERROR;
+	}
+
+	constexpr int subBucketBits = 3;
+	constexpr int subBuckets = 1 << subBucketBits;
+	constexpr int bucketCount = subBuckets + (64 - subBucketBits) * subBuckets;
+
+	inline int bucketIndex(uint64_t ns)
+	{
+		if (ns < subBuckets)
+		{
+			return static_cast<int>(ns);
+		}
+		int exponent = 63 - __builtin_clzll(ns);
+		int sub = static_cast<int>((ns >> (exponent - subBucketBits)) & (subBuckets - 1));
+		return subBuckets + (exponent - subBucketBits) * subBuckets + sub;
+	}
+
+	struct Totals
+	{
+		uint64_t outcomes[outcomeCount] = {};
+		uint64_t buckets[bucketCount] = {};
+		uint64_t sumNanoseconds = 0;
+	};
+
+	struct ThreadRecord
+	{
+		std::atomic<uint64_t> outcomes[outcomeCount] = {};
+		std::atomic<uint64_t> buckets[bucketCount] = {};
+		std::atomic<uint64_t> sumNanoseconds{0};
+
+		ThreadRecord();
+		~ThreadRecord();
+
+		static void bump(std::atomic<uint64_t> &value, uint64_t by)
+		{
+			value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+		}
+
+		void addTo(Totals &totals) const
+		{
+			for (int o = 0; o < outcomeCount; o++)
+			{
+				totals.outcomes[o] += outcomes[o].load(std::memory_order_relaxed);
+			}
+			for (int b = 0; b < bucketCount; b++)
+			{
+				totals.buckets[b] += buckets[b].load(std::memory_order_relaxed);
+			}
+			totals.sumNanoseconds += sumNanoseconds.load(std::memory_order_relaxed);
+		}
+	};
+
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<ThreadRecord *> live;
+		Totals retired;
+
+		static Registry &instance()
+		{
+			static Registry registry;
+			return registry;
+		}
+	};
+
+	inline ThreadRecord::ThreadRecord()
+	{
+		Registry &registry = Registry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.live.push_back(this);
+	}
+
+	inline ThreadRecord::~ThreadRecord()
+	{
+		Registry &registry = Registry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		addTo(registry.retired);
+		registry.live.erase(std::find(registry.live.begin(), registry.live.end(), this));
+	}
+
+	inline void record(Outcome outcome, uint64_t nanoseconds)
+	{
+		thread_local ThreadRecord threadRecord;
+		ThreadRecord::bump(threadRecord.outcomes[outcome], 1);
+		ThreadRecord::bump(threadRecord.buckets[bucketIndex(nanoseconds)], 1);
+		ThreadRecord::bump(threadRecord.sumNanoseconds, nanoseconds);
+	}
+
+	// Measures one request from construction to finish().
+	class RequestTimer
+	{
+	private:
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		RequestTimer() : start(std::chrono::steady_clock::now()) {}
+
+		void finish(Outcome outcome)
+		{
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			record(outcome, static_cast<uint64_t>(
+								std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+		}
+	};
+
+	inline Totals snapshot()
+	{
+		Registry &registry = Registry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		Totals totals = registry.retired;
+		for (ThreadRecord *r : registry.live)
+		{
+			r->addTo(totals);
+		}
+		return totals;
+	}
+
+	inline std::string renderPrometheus()
+	{
+		Totals totals = snapshot();
+		std::ostringstream out;
+		out << std::setprecision(12);
+
+		out << "# HELP rdp_evaluations_total Evaluations completed, by outcome.\n";
+		out << "# TYPE rdp_evaluations_total counter\n";
+		uint64_t count = 0;
+		for (int o = 0; o < outcomeCount; o++)
+		{
+			out << "rdp_evaluations_total{outcome=\"" << outcomeName(static_cast<Outcome>(o)) << "\"} "
+				<< totals.outcomes[o] << "\n";
+			count += totals.outcomes[o];
+		}
+
+		out << "# HELP rdp_evaluation_latency_seconds Time from request receipt to result.\n";
+		out << "# TYPE rdp_evaluation_latency_seconds histogram\n";
+		// Boundaries 2^10ns (~1us) to 2^34ns (~17s).
+		uint64_t cumulative = 0;
+		int next = 0;
+		for (int exponent = 10; exponent <= 34; exponent++)
+		{
+			int limit = subBuckets + (exponent - subBucketBits) * subBuckets;
+			for (; next < limit; next++)
+			{
+				cumulative += totals.buckets[next];
+			}
+			out << "rdp_evaluation_latency_seconds_bucket{le=\"" << (static_cast<double>(1ull << exponent) / 1e9)
+				<< "\"} " << cumulative << "\n";
+		}
+		out << "rdp_evaluation_latency_seconds_bucket{le=\"+Inf\"} " << count << "\n";
+		out << "rdp_evaluation_latency_seconds_sum " << (totals.sumNanoseconds / 1e9) << "\n";
+		out << "rdp_evaluation_latency_seconds_count " << count << "\n";
+		return out.str();
+	}
+
+	// Writes via a temporary file and rename so scrapers never see a partial file.
+	inline bool writeFile(const std::string &path)
+	{
+		std::string temporary = path + ".tmp";
+		{
+			std::ofstream file(temporary, std::ios::trunc);
+			file << renderPrometheus();
+			if (!file)
+			{
+				return false;
+			}
+		}
+		return std::rename(temporary.c_str(), path.c_str()) == 0;
+	}
+
+	// Background thread rewriting the metrics file at a fixed interval.
+	class FileExporter
+	{
+	private:
+		std::string path;
+		std::chrono::milliseconds interval;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+		std::thread thread;
+
+	public:
+		FileExporter(const std::string &file, std::chrono::milliseconds period)
+			: path(file), interval(period), thread([this]
+												   { run(); }) {}
+
+		~FileExporter()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			thread.join();
+			writeFile(path);
+		}
+
+	private:
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stopping)
+			{
+				lock.unlock();
+				writeFile(path);
+				lock.lock();
+				wake.wait_for(lock, interval, [this]
+							  { return stopping; });
+			}
+		}
+	};
+
+#ifdef __linux__
+	// Minimal HTTP endpoint on 127.0.0.1 serving GET /metrics.
+	class HttpExporter
+	{
+	private:
+		static constexpr int requestTimeoutMs = 2000;
+
+		int listener = -1;
+		int wake[2] = {-1, -1}; // written once to stop the thread
+		std::thread thread;
+
+		// Reads the request line within requestTimeoutMs; a client that is
+		// slow or silent is dropped, and stopping interrupts the wait.
+		void serveOne(int client)
+		{
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(requestTimeoutMs);
+			std::string request;
+			char buffer[1024];
+			while (request.find("\r\n") == std::string::npos && request.size() < sizeof(buffer))
+			{
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				pollfd fds[2] = {{client, POLLIN, 0}, {wake[0], POLLIN, 0}};
+				if (left.count() <= 0 || poll(fds, 2, static_cast<int>(left.count())) <= 0 || fds[1].revents)
+				{
+					close(client);
+					return;
+				}
+				ssize_t n = recv(client, buffer, sizeof(buffer), MSG_DONTWAIT);
+				if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				{
+					close(client);
+					return;
+				}
+				if (n > 0)
+				{
+					request.append(buffer, static_cast<size_t>(n));
+				}
+			}
+
+			std::string response;
+			if (request.compare(0, 13, "GET /metrics ") == 0)
+			{
+				std::string body = renderPrometheus();
+				response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+						   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+			}
+			else
+			{
+				response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+			}
+			timeval timeout = {requestTimeoutMs / 1000, (requestTimeoutMs % 1000) * 1000};
+			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			send(client, response.data(), response.size(), MSG_NOSIGNAL);
+			close(client);
+		}
+
+		void run()
+		{
+			for (;;)
+			{
+				pollfd fds[2] = {{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+				if (poll(fds, 2, -1) < 0 && errno != EINTR)
+				{
+					return;
+				}
+				if (fds[1].revents)
+				{
+					return;
+				}
+				if (fds[0].revents & POLLIN)
+				{
+					int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+					if (client >= 0)
+					{
+						serveOne(client);
+					}
+				}
+			}
+		}
+
+	public:
+		HttpExporter(uint16_t port)
+		{
+			listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (listener < 0)
+			{
+				throw std::runtime_error("Cannot create metrics socket");
+			}
+			int reuse = 1;
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			if (pipe2(wake, O_CLOEXEC) != 0)
+			{
+				close(listener);
+				throw std::runtime_error("Cannot create metrics wake-up pipe");
+			}
+
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(port);
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+				listen(listener, 16) != 0)
+			{
+				close(listener);
+				close(wake[0]);
+				close(wake[1]);
+				throw std::runtime_error("Cannot listen on metrics port " + std::to_string(port));
+			}
+			thread = std::thread([this]
+								 { run(); });
+		}
+
+		~HttpExporter()
+		{
+			char stop = 0;
+			while (write(wake[1], &stop, 1) < 0 && errno == EINTR)
+			{
+			}
+			thread.join();
+			close(listener);
+			close(wake[0]);
+			close(wake[1]);
+		}
+
+		HttpExporter(const HttpExporter &) = delete;
+		HttpExporter &operator=(const HttpExporter &) = delete;
+
+		// The port listened on, which the kernel picks when asked for 0.
+		uint16_t port() const
+		{
+			sockaddr_in address = {};
+			socklen_t length = sizeof(address);
+			getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length);
+			return ntohs(address.sin_port);
+		}
+	};
+#endif
+}
+
+class Bytecode;
+class ExpressionPool;
+
+// AST Node structure
+class ASTNode
+{
+public:
+	int line = 0;
+	int column = 0;
+
+	virtual ~ASTNode() = default;
+	virtual int evaluate() = 0;
+	virtual const char *kind() const = 0;
+	// Appends the node's code; it leaves exactly one value on the stack.
+	virtual void emit(Bytecode &code) const = 0;
+	// Returns the pool's canonical node for this subtree.
+	virtual std::shared_ptr<ASTNode> canonical(ExpressionPool &pool) const = 0;
+};
+
+// Per-node execution profiler
+// Counts executions and inclusive time per node, labelled kind@line:column,
+// and accumulates self time per call path (statement;if@1:1;then;add@1:18)
+// in the folded-stack format consumed by flamegraph.pl. Profiles are kept
+// per thread and reported for the calling thread.
+namespace profile
+{
+	struct NodeProfile
+	{
+		std::string label;
+		uint64_t count = 0;
+		uint64_t nanoseconds = 0;
+	};
+
+	struct Profiler
+	{
+		struct Open
+		{
+			NodeProfile *node;
+			size_t pathLength;
+			uint64_t start;
+			uint64_t children;
+		};
+
+		std::unordered_map<const ASTNode *, NodeProfile> nodes;
+		std::map<std::string, uint64_t> folded;
+		std::string path;
+		std::vector<Open> stack;
+	};
+
+	inline std::atomic<bool> &enabledFlag()
+	{
+		static std::atomic<bool> flag{false};
+		return flag;
+	}
+
+	inline bool enabled() { return enabledFlag().load(std::memory_order_relaxed); }
+	inline void enable() { enabledFlag().store(true, std::memory_order_relaxed); }
+
+	inline Profiler &profiler()
+	{
+		thread_local Profiler threadProfiler;
+		return threadProfiler;
+	}
+
+	inline uint64_t now()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+										 std::chrono::steady_clock::now().time_since_epoch())
+										 .count());
+	}
+
+	inline void enter(NodeProfile *node, const std::string &label)
+	{
+		Profiler &p = profiler();
+		p.stack.push_back({node, p.path.size(), 0, 0});
+		if (!p.path.empty())
+		{
+			p.path += ';';
+		}
+		p.path += label;
+		p.stack.back().start = now();
+	}
+
+	inline void exit()
+	{
+		uint64_t end = now();
+		Profiler &p = profiler();
+		Profiler::Open open = p.stack.back();
+		p.stack.pop_back();
+
+		uint64_t elapsed = end - open.start;
+		p.folded[p.path] += elapsed - std::min(elapsed, open.children);
+		p.path.resize(open.pathLength);
+		if (!p.stack.empty())
+		{
+			p.stack.back().children += elapsed;
+		}
+		if (open.node != nullptr)
+		{
+			open.node->count++;
+			open.node->nanoseconds += elapsed;
+		}
+	}
+
+	// Profiles the enclosing scope as a node or as a named pseudo-frame.
+	class Frame
+	{
+	private:
+		bool active;
+
+	public:
+		Frame(const char *label) : active(enabled())
+		{
+			if (active)
+			{
+				enter(nullptr, label);
+			}
+		}
+
+		Frame(const ASTNode &node) : active(enabled())
+		{
+			if (active)
+			{
+				NodeProfile &profile = profiler().nodes[&node];
+				if (profile.label.empty())
+				{
+					profile.label = std::string(node.kind()) + "@" + std::to_string(node.line) + ":" +
+									std::to_string(node.column);
+				}
+				enter(&profile, profile.label);
+			}
+		}
+
+		~Frame()
+		{
+			if (active)
+			{
+				exit();
+			}
+		}
+
+		Frame(const Frame &) = delete;
+		Frame &operator=(const Frame &) = delete;
+	};
+
+	inline void writeFolded(std::ostream &out)
+	{
+		for (const auto &entry : profiler().folded)
+		{
+			out << entry.first << " " << entry.second << "\n";
+		}
+	}
+
+	inline void report(std::ostream &out)
+	{
+		std::vector<const NodeProfile *> sorted;
+		for (const auto &entry : profiler().nodes)
+		{
+			sorted.push_back(&entry.second);
+		}
+		std::sort(sorted.begin(), sorted.end(), [](const NodeProfile *a, const NodeProfile *b)
+				  { return a->nanoseconds > b->nanoseconds; });
+
+		out << "node                     count     total(us)     avg(ns)\n";
+		for (const NodeProfile *node : sorted)
+		{
+			out << std::left << std::setw(20) << node->label << std::right
+				<< std::setw(10) << node->count
+				<< std::setw(14) << std::fixed << std::setprecision(1) << node->nanoseconds / 1000.0
+				<< std::setw(12) << (node->count ? static_cast<double>(node->nanoseconds) / node->count : 0.0)
+				<< "\n";
+		}
+		out.unsetf(std::ios::floatfield);
+	}
+}
+
+// Per-node evaluation scope: budget accounting, counters and profiling
+class EvaluationScope
+{
+private:
+	profile::Frame frame;
+
+public:
+	EvaluationScope(const ASTNode &node) : frame(node)
+	{
+		countEvaluation();
+	}
+};
+
+// Number Node
+class NumberNode : public ASTNode
+{
+private:
+	int value;
+
+public:
+	NumberNode(int val) : value(val) {}
+	const char *kind() const override { return "number"; }
+	void emit(Bytecode &code) const override;
+	std::shared_ptr<ASTNode> canonical(ExpressionPool &pool) const override;
+	int evaluate() override
+	{
+		EvaluationScope scope(*this);
+		return value;
+	}
+};
+
+// Concurrent variable store
+// Names are registered into open-addressed tables by CAS on the slot's name
+// pointer, so registration never takes a lock. A name is probed for in a
+// short window of each table in turn; when every table's window is taken, a
+// table twice the size of the last is chained on. Tables are never moved or
+// freed while the store lives, so a resolved slot stays valid and reads and
+// writes through it are single atomic operations. For the same reason names
+// are never removed: every distinct name resolved stays for good, so code
+// compiled for untrusted input gets its new names from an Environment.
+class VariableStore
+{
+public:
+	struct alignas(64) Slot
+	{
+		std::atomic<const std::string *> name{nullptr};
+		std::atomic<int> value{0};
+		std::atomic<bool> defined{false};
+
+		bool load(int &out) const
+		{
+			if (!defined.load(std::memory_order_acquire))
+			{
+				return false;
+			}
+			out = value.load(std::memory_order_relaxed);
+			return true;
+		}
+
+		void store(int val)
+		{
+			value.store(val, std::memory_order_relaxed);
+			defined.store(true, std::memory_order_release);
+		}
+	};
+
+	static constexpr size_t initialCapacity = 1024;
+	static constexpr size_t probeWindow = 32;
+
+	VariableStore()
+	{
+		alloc::NodeScope unattributed(nullptr);
+		head = new Table(initialCapacity);
+	}
+	VariableStore(const VariableStore &) = delete;
+	VariableStore &operator=(const VariableStore &) = delete;
+
+	~VariableStore()
+	{
+		Table *table = head;
+		while (table != nullptr)
+		{
+			Table *next = table->next.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < table->capacity; i++)
+			{
+				delete table->slots[i].name.load(std::memory_order_relaxed);
+			}
+			delete table;
+			table = next;
+		}
+	}
+
+	// Returns the slot for name, registering it if it is not yet present.
+	Slot *resolve(const std::string &name)
+	{
+		size_t h = hash(name);
+		std::string *owned = nullptr;
+
+		for (Table *table = head;; table = grow(table))
+		{
+			for (size_t probe = 0; probe < probeWindow; probe++)
+			{
+				Slot &slot = table->slots[(h + probe) & (table->capacity - 1)];
+				const std::string *current = slot.name.load(std::memory_order_acquire);
+
+				if (current == nullptr)
+				{
+					if (owned == nullptr)
+					{
+						// Names belong to the store, not the node that resolved them.
+						alloc::NodeScope unattributed(nullptr);
+						owned = new std::string(name);
+					}
+					if (slot.name.compare_exchange_strong(current, owned,
+														  std::memory_order_acq_rel,
+														  std::memory_order_acquire))
+					{
+						return &slot;
+					}
+					// Lost the race; current now holds the winner's name.
+				}
+
+				if (*current == name)
+				{
+					delete owned;
+					return &slot;
+				}
+			}
+		}
+	}
+
+	// Marks every variable undefined; registered slots stay valid.
+	void clearValues()
+	{
+		for (Table *table = head; table != nullptr; table = table->next.load(std::memory_order_acquire))
+		{
+			for (size_t i = 0; i < table->capacity; i++)
+			{
+				table->slots[i].defined.store(false, std::memory_order_release);
+			}
+		}
+	}
+
+	// Returns the slot for name without registering it, or nullptr.
+	Slot *find(const std::string &name)
+	{
+		size_t h = hash(name);
+
+		for (Table *table = head; table != nullptr; table = table->next.load(std::memory_order_acquire))
+		{
+			for (size_t probe = 0; probe < probeWindow; probe++)
+			{
+				Slot &slot = table->slots[(h + probe) & (table->capacity - 1)];
+				const std::string *current = slot.name.load(std::memory_order_acquire);
+				if (current == nullptr)
+				{
+					return nullptr;
+				}
+				if (*current == name)
+				{
+					return &slot;
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	// Number of slots across all tables.
+	size_t capacity() const
+	{
+		size_t total = 0;
+		for (Table *table = head; table != nullptr; table = table->next.load(std::memory_order_acquire))
+		{
+			total += table->capacity;
+		}
+		return total;
+	}
+
+private:
+	struct Table
+	{
+		size_t capacity;
+		std::unique_ptr<Slot[]> slots;
+		std::atomic<Table *> next{nullptr};
+
+		Table(size_t size) : capacity(size), slots(new Slot[size]) {}
+	};
+
+	Table *head;
+
+	// The table after full, chaining a new one on if no thread has yet.
+	static Table *grow(Table *full)
+	{
+		Table *next = full->next.load(std::memory_order_acquire);
+		if (next != nullptr)
+		{
+			return next;
+		}
+		alloc::NodeScope unattributed(nullptr);
+		Table *created = new Table(full->capacity * 2);
+		if (full->next.compare_exchange_strong(next, created, std::memory_order_acq_rel,
+											   std::memory_order_acquire))
+		{
+			return created;
+		}
+		delete created;
+		return next;
+	}
+
+	static size_t hash(const std::string &name)
+	{
+		uint64_t h = 14695981039346656037ull;
+		for (char c : name)
+		{
+			h ^= static_cast<unsigned char>(c);
+			h *= 1099511628211ull;
+		}
+		return static_cast<size_t>(h);
+	}
+};
+
+// Variable Node
+class VariableNode : public ASTNode
+{
+private:
+	std::string name;
+	VariableStore::Slot *slot;
+	// Created on first use, so processes that never name a variable skip it.
+	static VariableStore &variables()
+	{
+		static VariableStore store;
+		return store;
+	}
+
+public:
+	VariableNode(const std::string &varName) : name(varName), slot(variables().resolve(varName)) {}
+	const char *kind() const override { return "variable"; }
+	void emit(Bytecode &code) const override;
+	std::shared_ptr<ASTNode> canonical(ExpressionPool &pool) const override;
+	int evaluate() override
+	{
+		EvaluationScope scope(*this);
+		int value;
+		if (!slot->load(value))
+		{
+			throw UndefinedVariableError(name);
+		}
+		return value;
+	}
+	static VariableStore::Slot *resolve(const std::string &name)
+	{
+		return variables().resolve(name);
+	}
+	// The slot for name if any program has used it, without registering it.
+	static VariableStore::Slot *find(const std::string &name)
+	{
+		return variables().find(name);
+	}
+	static void setVariable(const std::string &name, int value)
+	{
+		variables().resolve(name)->store(value);
+	}
+	static void clearVariables()
+	{
+		variables().clearValues();
+	}
+};
+
+// Binary Operation Node
+class BinaryOpNode : public ASTNode
+{
+private:
+	std::shared_ptr<ASTNode> left;
+	std::shared_ptr<ASTNode> right;
+	TokenType op;
+
+public:
+	BinaryOpNode(std::shared_ptr<ASTNode> l, TokenType operation, std::shared_ptr<ASTNode> r)
+		: left(l), op(operation), right(r) {}
+
+	const char *kind() const override
+	{
+		switch (op)
+		{
+		case TokenType::PLUS:
+			return "add";
+		case TokenType::MINUS:
+			return "subtract";
+		case TokenType::MULTIPLY:
+			return "multiply";
+		case TokenType::DIVIDE:
+			return "divide";
+		default:
+			return "binary";
+		}
+	}
+
+	void emit(Bytecode &code) const override;
+	std::shared_ptr<ASTNode> canonical(ExpressionPool &pool) const override;
+
+	// Canonical operands of the chain of op that this node heads.
+	void operands(TokenType chain, ExpressionPool &pool, std::vector<std::shared_ptr<ASTNode>> &out) const;
+
+	static int apply(TokenType op, int leftVal, int rightVal)
+	{
+		switch (op)
+		{
+		case TokenType::PLUS:
+			return leftVal + rightVal;
+		case TokenType::MINUS:
+			return leftVal - rightVal;
+		case TokenType::MULTIPLY:
+			return leftVal * rightVal;
+		case TokenType::DIVIDE:
+			if (rightVal == 0)
+				throw DivisionByZeroError();
+			return leftVal / rightVal;
+		default:
+			throw std::runtime_error("Invalid operator");
+		}
+	}
+
+	int evaluate() override
+	{
+		EvaluationScope scope(*this);
+		int leftVal = left->evaluate();
+		int rightVal = right->evaluate();
+		return apply(op, leftVal, rightVal);
+	}
+};
+
+// Assignment Node
+class AssignmentNode : public ASTNode
+{
+private:
+	std::string name;
+	VariableStore::Slot *slot;
+	std::shared_ptr<ASTNode> value;
+
+public:
+	AssignmentNode(const std::string &varName, std::shared_ptr<ASTNode> val)
+		: name(varName), slot(VariableNode::resolve(varName)), value(val) {}
+
+	const char *kind() const override { return "assign"; }
+	void emit(Bytecode &code) const override;
+	std::shared_ptr<ASTNode> canonical(ExpressionPool &pool) const override;
+
+	int evaluate() override
+	{
+		EvaluationScope scope(*this);
+		int val = value->evaluate();
+		slot->store(val);
+		return val;
+	}
+};
+
+// If Node
+class IfNode : public ASTNode
+{
+private:
+	std::shared_ptr<ASTNode> condition;
+	std::shared_ptr<ASTNode> thenBranch;
+	std::shared_ptr<ASTNode> elseBranch;
+
+public:
+	IfNode(std::shared_ptr<ASTNode> cond, std::shared_ptr<ASTNode> then, std::shared_ptr<ASTNode> else_)
+		: condition(cond), thenBranch(then), elseBranch(else_) {}
+
+	const char *kind() const override { return "if"; }
+	void emit(Bytecode &code) const override;
+	std::shared_ptr<ASTNode> canonical(ExpressionPool &pool) const override;
+
+	int evaluate() override
+	{
+		EvaluationScope scope(*this);
+		if (condition->evaluate() != 0)
+		{
+			profile::Frame branch("then");
+			return thenBranch->evaluate();
+		}
+		else if (elseBranch)
+		{
+			profile::Frame branch("else");
+			return elseBranch->evaluate();
+		}
+		return 0;
+	}
+};
+
+// Vector with inline room for N elements
+// Elements live inside the object itself until there are more than N, and
+// only then move to the heap. Limited to trivially copyable types, so that
+// growing and copying are plain memcpy. clear() keeps any heap capacity.
+template <typename T, size_t N>
+class SmallVector
+{
+	static_assert(std::is_trivially_copyable<T>::value, "SmallVector holds trivially copyable types");
+
+private:
+	T *items;
+	size_t count = 0;
+	size_t capacity = N;
+	alignas(T) unsigned char storage[N * sizeof(T)];
+
+	T *inlineItems() { return reinterpret_cast<T *>(storage); }
+	bool onHeap() const { return items != reinterpret_cast<const T *>(storage); }
+
+	void release()
+	{
+		if (onHeap())
+		{
+			::operator delete(items);
+		}
+		items = inlineItems();
+		capacity = N;
+		count = 0;
+	}
+
+	void steal(SmallVector &other)
+	{
+		if (other.onHeap())
+		{
+			items = other.items;
+			capacity = other.capacity;
+			other.items = other.inlineItems();
+			other.capacity = N;
+		}
+		else
+		{
+			std::memcpy(static_cast<void *>(items), other.items, other.count * sizeof(T));
+		}
+		count = other.count;
+		other.count = 0;
+	}
+
+public:
+	SmallVector() : items(inlineItems()) {}
+
+	SmallVector(const SmallVector &other) : items(inlineItems())
+	{
+		reserve(other.count);
+		std::memcpy(static_cast<void *>(items), other.items, other.count * sizeof(T));
+		count = other.count;
+	}
+
+	SmallVector(SmallVector &&other) noexcept : items(inlineItems()) { steal(other); }
+
+	~SmallVector() { release(); }
+
+	SmallVector &operator=(const SmallVector &other)
+	{
+		if (this != &other)
+		{
+			count = 0;
+			reserve(other.count);
+			std::memcpy(static_cast<void *>(items), other.items, other.count * sizeof(T));
+			count = other.count;
+		}
+		return *this;
+	}
+
+	SmallVector &operator=(SmallVector &&other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			steal(other);
+		}
+		return *this;
+	}
+
+	void reserve(size_t wanted)
+	{
+		if (wanted <= capacity)
+		{
+			return;
+		}
+		size_t grown = std::max(wanted, capacity * 2);
+		T *moved = static_cast<T *>(::operator new(grown * sizeof(T)));
+		std::memcpy(static_cast<void *>(moved), items, count * sizeof(T));
+		if (onHeap())
+		{
+			::operator delete(items);
+		}
+		items = moved;
+		capacity = grown;
+	}
+
+	void push_back(const T &item)
+	{
+		if (count == capacity)
+		{
+			reserve(count + 1);
+		}
+		items[count++] = item;
+	}
+
+	void resize(size_t size)
+	{
+		reserve(size);
+		for (size_t i = count; i < size; i++)
+		{
+			items[i] = T();
+		}
+		count = size;
+	}
+
+	void clear() { count = 0; }
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	// True while the elements still fit in the object itself.
+	bool isInline() const { return !onHeap(); }
+
+	T *data() { return items; }
+	const T *data() const { return items; }
+	T &operator[](size_t index) { return items[index]; }
+	const T &operator[](size_t index) const { return items[index]; }
+	T *begin() { return items; }
+	T *end() { return items + count; }
+	const T *begin() const { return items; }
+	const T *end() const { return items + count; }
+};
+
+// Compiled program
+// Flat code for a stack machine. Numbers are immediates and variables are
+// indices into a table of store slots resolved at compile time, so running
+// it neither allocates nor hashes a name. Jumps only go forward: the
+// language has no loops, so a program runs at most code.size() instructions.
+// Small programs fit entirely inside the object, so a Bytecode held on the
+// stack or as a member needs no heap at all.
+class Bytecode
+{
+public:
+	enum class Op : uint8_t
+	{
+		PUSH,		  // operand: value
+		LOAD,		  // operand: slot index
+		STORE,		  // operand: slot index; the value stays on the stack
+		ADD,
+		SUBTRACT,
+		MULTIPLY,
+		DIVIDE,
+		JUMP,		  // operand: target
+		JUMP_IF_ZERO, // operand: target; pops the condition
+		POP
+	};
+
+	struct Instruction
+	{
+		Op op;
+		int32_t operand;
+	};
+
+	static constexpr size_t inlineInstructions = 16;
+	static constexpr size_t inlineSlots = 8;
+
+	SmallVector<Instruction, inlineInstructions> code;
+	SmallVector<VariableStore::Slot *, inlineSlots> slots;
+	int maxDepth = 0;
+
+	size_t size() const { return code.size(); }
+
+	size_t emit(Op op, int32_t operand = 0)
+	{
+		code.push_back({op, operand});
+		switch (op)
+		{
+		case Op::PUSH:
+		case Op::LOAD:
+			grow(1);
+			break;
+		case Op::STORE:
+		case Op::JUMP:
+			break;
+		default:
+			depth--;
+		}
+		return code.size() - 1;
+	}
+
+	void emitBinary(TokenType op)
+	{
+		switch (op)
+		{
+		case TokenType::PLUS:
+			emit(Op::ADD);
+			break;
+		case TokenType::MINUS:
+			emit(Op::SUBTRACT);
+			break;
+		case TokenType::MULTIPLY:
+			emit(Op::MULTIPLY);
+			break;
+		case TokenType::DIVIDE:
+			emit(Op::DIVIDE);
+			break;
+		default:
+			throw std::runtime_error("Invalid operator");
+		}
+	}
+
+	int32_t slot(VariableStore::Slot *variable)
+	{
+		slots.push_back(variable);
+		return static_cast<int32_t>(slots.size() - 1);
+	}
+
+	// Points the jump at index to the next instruction emitted.
+	void patch(size_t index) { code[index].operand = static_cast<int32_t>(code.size()); }
+
+	// Statements each leave a value; only the last one's is kept.
+	void beginStatement()
+	{
+		if (statements++ > 0)
+		{
+			emit(Op::POP);
+		}
+	}
+
+	// Back-patched if/else. After the condition: beginIf, the then branch,
+	// beginElse, the else branch if there is one, then endIf.
+	struct Branch
+	{
+		size_t toElse;
+		size_t toEnd;
+		int depth;
+	};
+
+	Branch beginIf()
+	{
+		size_t toElse = emit(Op::JUMP_IF_ZERO);
+		return {toElse, 0, depth};
+	}
+
+	void beginElse(Branch &branch)
+	{
+		branch.toEnd = emit(Op::JUMP);
+		depth = branch.depth;
+		patch(branch.toElse);
+	}
+
+	void endIf(const Branch &branch, bool hasElse)
+	{
+		if (!hasElse)
+		{
+			emit(Op::PUSH, 0);
+		}
+		patch(branch.toEnd);
+	}
+
+	void clear()
+	{
+		code.clear();
+		slots.clear();
+		maxDepth = 0;
+		beginProgram();
+	}
+
+	// Starts another independent program after the code already emitted.
+	void beginProgram()
+	{
+		depth = 0;
+		statements = 0;
+	}
+
+	// Drops everything emitted after the given sizes, e.g. a failed program.
+	void truncate(size_t codeSize, size_t slotCount)
+	{
+		code.resize(codeSize);
+		slots.resize(slotCount);
+	}
+
+	// Lowers parsed statements to bytecode.
+	static Bytecode lower(const std::vector<std::shared_ptr<ASTNode>> &program)
+	{
+		stats::PhaseScope timer(stats::COMPILE);
+		alloc::PhaseScope allocations(stats::COMPILE);
+		trace::Span span("lower");
+		Bytecode code;
+		for (const auto &statement : program)
+		{
+			code.beginStatement();
+			statement->emit(code);
+		}
+		span.arg("instructions", static_cast<int64_t>(code.size()));
+		return code;
+	}
+
+private:
+	int depth = 0;
+	size_t statements = 0;
+
+	void grow(int by)
+	{
+		depth += by;
+		maxDepth = std::max(maxDepth, depth);
+	}
+};
+
+void NumberNode::emit(Bytecode &code) const
+{
+	code.emit(Bytecode::Op::PUSH, value);
+}
+
+void VariableNode::emit(Bytecode &code) const
+{
+	code.emit(Bytecode::Op::LOAD, code.slot(slot));
+}
+
+void BinaryOpNode::emit(Bytecode &code) const
+{
+	left->emit(code);
+	right->emit(code);
+	code.emitBinary(op);
+}
+
+void AssignmentNode::emit(Bytecode &code) const
+{
+	value->emit(code);
+	code.emit(Bytecode::Op::STORE, code.slot(slot));
+}
+
+void IfNode::emit(Bytecode &code) const
+{
+	condition->emit(code);
+	Bytecode::Branch branch = code.beginIf();
+	thenBranch->emit(code);
+	code.beginElse(branch);
+	if (elseBranch)
+	{
+		elseBranch->emit(code);
+	}
+	code.endIf(branch, elseBranch != nullptr);
+}
+
+// Variables private to one evaluation
+// By default, values held here stand in for variables the shared store does
+// not have, such as values fetched for this evaluation alone, and assignments
+// go to the shared store. An ISOLATED environment instead shadows the store
+// and keeps assignments to itself, for requests that must leave no trace.
+// A program compiled against an environment gets slots owned by it for
+// names the store has not registered, so those names never reach the store.
+// Lookups are linear, as an environment holds a handful of variables.
+class Environment
+{
+public:
+	enum Mode
+	{
+		FALLBACK,
+		ISOLATED
+	};
+
+	explicit Environment(Mode mode = FALLBACK) : mode(mode) {}
+
+	// Binds name; false if no program has used the name, as none can read it.
+	bool bind(const std::string &name, int value)
+	{
+		VariableStore::Slot *slot = VariableNode::find(name);
+		for (size_t i = 0; slot == nullptr && i < locals.size(); i++)
+		{
+			if (locals[i]->name == name)
+			{
+				slot = &locals[i]->slot;
+			}
+		}
+		if (slot == nullptr)
+		{
+			return false;
+		}
+		set(slot, value);
+		return true;
+	}
+
+	// A slot for name that lives as long as this environment and is never
+	// defined in itself; only the environment holds its value.
+	VariableStore::Slot *local(const std::string &name)
+	{
+		for (const std::unique_ptr<Local> &existing : locals)
+		{
+			if (existing->name == name)
+			{
+				return &existing->slot;
+			}
+		}
+		locals.emplace_back(new Local);
+		Local &created = *locals.back();
+		created.name = name;
+		created.slot.name.store(&created.name, std::memory_order_release);
+		return &created.slot;
+	}
+
+	void set(const VariableStore::Slot *slot, int value)
+	{
+		for (Entry &entry : entries)
+		{
+			if (entry.slot == slot)
+			{
+				entry.value = value;
+				return;
+			}
+		}
+		entries.push_back({slot, value});
+	}
+
+	// In FALLBACK mode the shared store first, so assignments made since are
+	// seen; in ISOLATED mode the local values first.
+	bool load(const VariableStore::Slot *slot, int &out) const
+	{
+		if (mode == FALLBACK && slot->load(out))
+		{
+			return true;
+		}
+		for (const Entry &entry : entries)
+		{
+			if (entry.slot == slot)
+			{
+				out = entry.value;
+				return true;
+			}
+		}
+		return mode == ISOLATED && slot->load(out);
+	}
+
+	void store(VariableStore::Slot *slot, int value)
+	{
+		if (mode == ISOLATED)
+		{
+			set(slot, value);
+			return;
+		}
+		slot->store(value);
+	}
+
+	size_t size() const { return entries.size(); }
+	void clear() { entries.clear(); }
+
+private:
+	struct Entry
+	{
+		const VariableStore::Slot *slot;
+		int value;
+	};
+
+	struct Local
+	{
+		std::string name;
+		VariableStore::Slot slot;
+	};
+
+	Mode mode;
+	SmallVector<Entry, 8> entries;
+	std::vector<std::unique_ptr<Local>> locals;
+};
+
+// Bytecode interpreter
+// Keeps its stack between runs. An instruction counts as one evaluated node;
+// the active EvalBudget is charged every checkInterval instructions, or at
+// the exact instruction where its next check falls. One loop serves every
+// run; what LOAD and STORE do is a template parameter, so the plain
+// shared-store run pays nothing for the others.
+class VirtualMachine
+{
+public:
+	// A run that stops at a variable nobody has yet and resumes later
+	// Holds the program counter, the operand stack and the environment of
+	// one evaluation between resumptions.
+	struct Frame
+	{
+		size_t pc = 0;
+		std::vector<int> stack;
+		Environment environment;
+		// The variable a suspended run is waiting for.
+		const VariableStore::Slot *missing = nullptr;
+		bool finished = false;
+		int result = 0;
+	};
+
+	int run(const Bytecode &program) { return run(program, 0, program.size()); }
+
+	// Runs the instructions in [begin, end), which must hold whole programs.
+	int run(const Bytecode &program, size_t begin, size_t end)
+	{
+		SharedVariables variables{program};
+		return start(program, begin, end, variables);
+	}
+
+	// Runs with variables the store lacks taken from environment.
+	int run(const Bytecode &program, Environment &environment)
+	{
+		LocalVariables variables{program, environment};
+		return start(program, 0, program.size(), variables);
+	}
+
+	int run(const Bytecode &program, EvalBudget &budget)
+	{
+		EvalBudget::Scope scope(budget);
+		return run(program);
+	}
+
+	// Runs frame on until the program finishes (true, with frame.result set)
+	// or loads a variable that neither the store nor frame.environment has
+	// (false, with frame.missing set). The load is retried on resumption.
+	bool resume(const Bytecode &program, Frame &frame)
+	{
+		stats::PhaseScope timer(stats::EVALUATE);
+		alloc::PhaseScope allocations(stats::EVALUATE);
+		trace::Span span("run");
+
+		if (frame.finished)
+		{
+			return true;
+		}
+		reserve(program);
+		std::copy(frame.stack.begin(), frame.stack.end(), stack.begin());
+		int *top = stack.data() + frame.stack.size() - 1;
+		size_t pc = frame.pc;
+		FetchingVariables variables{program, frame};
+		frame.missing = nullptr;
+		if (execute(program, pc, program.size(), top, variables))
+		{
+			frame.finished = true;
+			frame.result = program.size() == 0 ? 0 : *top;
+			frame.stack.clear();
+			return true;
+		}
+		frame.pc = pc;
+		frame.stack.assign(stack.data(), top + 1);
+		return false;
+	}
+
+private:
+	std::vector<int> stack;
+
+	struct SharedVariables
+	{
+		const Bytecode &program;
+
+		bool load(size_t index, int &out)
+		{
+			VariableStore::Slot *slot = program.slots[index];
+			if (!slot->load(out))
+			{
+				throw UndefinedVariableError(*slot->name.load(std::memory_order_acquire));
+			}
+			return true;
+		}
+
+		void store(size_t index, int value) { program.slots[index]->store(value); }
+	};
+
+	struct LocalVariables
+	{
+		const Bytecode &program;
+		Environment &environment;
+
+		bool load(size_t index, int &out)
+		{
+			VariableStore::Slot *slot = program.slots[index];
+			if (!environment.load(slot, out))
+			{
+				throw UndefinedVariableError(*slot->name.load(std::memory_order_acquire));
+			}
+			return true;
+		}
+
+		void store(size_t index, int value) { environment.store(program.slots[index], value); }
+	};
+
+	struct FetchingVariables
+	{
+		const Bytecode &program;
+		Frame &frame;
+
+		bool load(size_t index, int &out)
+		{
+			VariableStore::Slot *slot = program.slots[index];
+			if (!frame.environment.load(slot, out))
+			{
+				frame.missing = slot;
+				return false;
+			}
+			return true;
+		}
+
+		void store(size_t index, int value) { frame.environment.store(program.slots[index], value); }
+	};
+
+	void reserve(const Bytecode &program)
+	{
+		if (stack.size() < static_cast<size_t>(program.maxDepth))
+		{
+			stack.resize(static_cast<size_t>(program.maxDepth));
+		}
+	}
+
+	template <typename Variables>
+	int start(const Bytecode &program, size_t begin, size_t end, Variables &variables)
+	{
+		stats::PhaseScope timer(stats::EVALUATE);
+		alloc::PhaseScope allocations(stats::EVALUATE);
+		trace::Span span("run");
+
+		if (begin == end)
+		{
+			return 0;
+		}
+		reserve(program);
+		int *top = stack.data() - 1;
+		size_t pc = begin;
+		execute(program, pc, end, top, variables);
+		return *top;
+	}
+
+	// Instructions to run before the next charge: a full interval, or exactly
+	// what is left when the budget's next check is closer than that.
+	static uint64_t chargeInterval(const EvalBudget *budget)
+	{
+		return budget ? std::min(EvalBudget::checkInterval, budget->untilCheck()) : EvalBudget::checkInterval;
+	}
+
+	// Returns false, with pc at the load, if variables could not supply one.
+	template <typename Variables>
+	bool execute(const Bytecode &program, size_t &pc, size_t end, int *&top, Variables &variables)
+	{
+		EvalBudget *budget = EvalBudget::current();
+		const Bytecode::Instruction *code = program.code.data();
+		uint64_t executed = 0;
+		uint64_t interval = chargeInterval(budget);
+		uint64_t countdown = interval;
+		bool completed = true;
+
+		while (pc < end)
+		{
+			const Bytecode::Instruction &instruction = code[pc++];
+			if (--countdown == 0)
+			{
+				executed += interval;
+				if (budget)
+				{
+					budget->charge(interval);
+				}
+				interval = chargeInterval(budget);
+				countdown = interval;
+			}
+
+			switch (instruction.op)
+			{
+			case Bytecode::Op::PUSH:
+				*++top = instruction.operand;
+				break;
+			case Bytecode::Op::LOAD:
+				if (!variables.load(static_cast<size_t>(instruction.operand), top[1]))
+				{
+					pc--;
+					completed = false;
+					end = pc;
+					break;
+				}
+				top++;
+				break;
+			case Bytecode::Op::STORE:
+				variables.store(static_cast<size_t>(instruction.operand), *top);
+				break;
+			case Bytecode::Op::ADD:
+				top--;
+				*top = *top + top[1];
+				break;
+			case Bytecode::Op::SUBTRACT:
+				top--;
+				*top = *top - top[1];
+				break;
+			case Bytecode::Op::MULTIPLY:
+				top--;
+				*top = *top * top[1];
+				break;
+			case Bytecode::Op::DIVIDE:
+				top--;
+				if (top[1] == 0)
+				{
+					throw DivisionByZeroError();
+				}
+				*top = *top / top[1];
+				break;
+			case Bytecode::Op::JUMP:
+				pc = static_cast<size_t>(instruction.operand);
+				break;
+			case Bytecode::Op::JUMP_IF_ZERO:
+				if (*top-- == 0)
+				{
+					pc = static_cast<size_t>(instruction.operand);
+				}
+				break;
+			case Bytecode::Op::POP:
+				top--;
+				break;
+			}
+		}
+
+		uint64_t remainder = interval - countdown;
+		if (budget && remainder > 0)
+		{
+			budget->charge(remainder);
+		}
+		stats::count(stats::NODES_EVALUATED, executed + remainder);
+		return completed;
+	}
+};
+
+// Lexical core
+// Scans straight out of a caller-owned buffer and never allocates; both the
+// Lexer and the Recognizer are built on it. Position state lives here, the
+// text does not, so a Scanner can follow its buffer when that is moved.
+class Scanner
+{
+public:
+	struct Lexeme
+	{
+		TokenType type;
+		size_t offset;
+		size_t length;
+		int line;
+		int column;
+	};
+
+private:
+	size_t position = 0;
+	int line = 1;
+	int column = 1;
+
+	static bool is(int (*test)(int), char c) { return test(static_cast<unsigned char>(c)) != 0; }
+
+	void advance(const char *data)
+	{
+		if (data[position] == '\n')
+		{
+			line++;
+			column = 1;
+		}
+		else
+		{
+			column++;
+		}
+		position++;
+	}
+
+	static bool keyword(const char *data, const Lexeme &lexeme, const char *word, size_t length)
+	{
+		return lexeme.length == length && std::memcmp(data + lexeme.offset, word, length) == 0;
+	}
+
+public:
+	// Fills lexeme with the next token. A character that cannot start one is
+	// consumed, reported in lexeme as INVALID and makes this return false.
+	bool next(const char *data, size_t length, Lexeme &lexeme)
+	{
+		while (position < length && is(isspace, data[position]))
+		{
+			advance(data);
+		}
+		lexeme = {TokenType::END, position, 0, line, column};
+		if (position >= length)
+		{
+			return true;
+		}
+
+		char c = data[position];
+		if (is(isdigit, c))
+		{
+			lexeme.type = TokenType::NUMBER;
+			while (position < length && is(isdigit, data[position]))
+			{
+				advance(data);
+			}
+		}
+		else if (is(isalpha, c))
+		{
+			while (position < length && (is(isalnum, data[position]) || data[position] == '_'))
+			{
+				advance(data);
+			}
+			lexeme.length = position - lexeme.offset;
+			if (keyword(data, lexeme, "if", 2))
+				lexeme.type = TokenType::IF;
+			else if (keyword(data, lexeme, "then", 4))
+				lexeme.type = TokenType::THEN;
+			else if (keyword(data, lexeme, "else", 4))
+				lexeme.type = TokenType::ELSE;
+			else if (keyword(data, lexeme, "endif", 5))
+				lexeme.type = TokenType::ENDIF;
+			else
+				lexeme.type = TokenType::IDENTIFIER;
+		}
+		else
+		{
+			switch (c)
+			{
+			case '+':
+				lexeme.type = TokenType::PLUS;
+				break;
+			case '-':
+				lexeme.type = TokenType::MINUS;
+				break;
+			case '*':
+				lexeme.type = TokenType::MULTIPLY;
+				break;
+			case '/':
+				lexeme.type = TokenType::DIVIDE;
+				break;
+			case '=':
+				lexeme.type = TokenType::ASSIGN;
+				break;
+			case '(':
+				lexeme.type = TokenType::LPAREN;
+				break;
+			case ')':
+				lexeme.type = TokenType::RPAREN;
+				break;
+			default:
+				advance(data);
+				lexeme.type = TokenType::INVALID;
+				lexeme.length = 1;
+				return false;
+			}
+			advance(data);
+		}
+		lexeme.length = position - lexeme.offset;
+		return true;
+	}
+};
+
+// Token-at-a-time reader over a Scanner for the parsers that build no
+// tree; it reports errors with the same exceptions and messages as Parser.
+class TokenCursor
+{
+protected:
+	const char *data;
+	size_t length;
+	Scanner scanner;
+	Scanner::Lexeme current;
+	std::string name; // scratch for variable lookups
+	// If set, owns the slots of names the store has not registered.
+	Environment *locals = nullptr;
+
+	TokenCursor(const char *text, size_t size) : data(text), length(size)
+	{
+		advance();
+	}
+
+	void restart(const char *text, size_t size)
+	{
+		data = text;
+		length = size;
+		scanner = Scanner();
+		advance();
+	}
+
+	void advance()
+	{
+		stats::count(stats::TOKENS);
+		if (!scanner.next(data, length, current))
+		{
+			throw ParseError("Invalid character: " + std::string(1, data[current.offset]));
+		}
+	}
+
+	void eat(TokenType type)
+	{
+		if (current.type != type)
+		{
+			size_t shown = current.type == TokenType::MULTIPLY ? 0 : current.length;
+			throw ParseError("Unexpected token: " + std::string(data + current.offset, shown));
+		}
+		advance();
+	}
+
+	// Same range as std::stoi, which Parser uses.
+	int number() const
+	{
+		int64_t value = 0;
+		for (size_t i = 0; i < current.length; i++)
+		{
+			value = value * 10 + (data[current.offset + i] - '0');
+			if (value > INT_MAX)
+			{
+				throw std::out_of_range("stoi");
+			}
+		}
+		return static_cast<int>(value);
+	}
+
+	VariableStore::Slot *slot(const Scanner::Lexeme &at)
+	{
+		name.assign(data + at.offset, at.length);
+		if (locals != nullptr)
+		{
+			VariableStore::Slot *shared = VariableNode::find(name);
+			return shared != nullptr ? shared : locals->local(name);
+		}
+		return VariableNode::resolve(name);
+	}
+};
+
+// Lexer class
+class Lexer
+{
+private:
+	std::string input;
+	Scanner scanner;
+	Position last{1, 1};
+	size_t tokens = 0;
+
+public:
+	Lexer(const std::string &text) : input(text) { checkSize(); }
+
+	// Starts over on new text; the input buffer keeps its capacity.
+	void reset(const std::string &text) { reset(text.data(), text.size()); }
+
+	void reset(const char *text, size_t size)
+	{
+		input.assign(text, size);
+		checkSize();
+		scanner = Scanner();
+		last = {1, 1};
+		tokens = 0;
+	}
+
+	Token nextToken()
+	{
+		Token token;
+		nextToken(token);
+		return token;
+	}
+
+	// Not timed per token: lexing on demand is part of the caller's phase,
+	// and the counter is added up by the caller from tokenCount().
+	void nextToken(Token &token)
+	{
+		tokens++;
+		scan(token);
+	}
+
+	// Where the token returned last starts.
+	Position position() const { return last; }
+
+	// Text of a token from this lexer's current input.
+	std::string_view text(const Token &token) const
+	{
+		size_t length = token.length;
+		if (token.flags & Token::LONG)
+		{
+			// Only identifiers and numbers get this long; rescan the run.
+			while (token.offset + length < input.size() &&
+				   (std::isalnum(static_cast<unsigned char>(input[token.offset + length])) ||
+					input[token.offset + length] == '_'))
+			{
+				length++;
+			}
+		}
+		return std::string_view(input.data() + token.offset, length);
+	}
+
+	size_t tokenCount() const { return tokens; }
+
+private:
+	// Offsets are 32-bit.
+	void checkSize() const
+	{
+		if (input.size() > UINT32_MAX)
+		{
+			throw ParseError("Input too large");
+		}
+	}
+
+	void scan(Token &token)
+	{
+		Scanner::Lexeme lexeme;
+		if (!scanner.next(input.data(), input.size(), lexeme))
+		{
+			throw ParseError("Invalid character: " + input.substr(lexeme.offset, 1));
+		}
+		last = {lexeme.line, lexeme.column};
+		token.type = lexeme.type;
+		token.flags = 0;
+		token.offset = static_cast<uint32_t>(lexeme.offset);
+		if (lexeme.length > UINT16_MAX)
+		{
+			token.length = UINT16_MAX;
+			token.flags |= Token::LONG;
+		}
+		else
+		{
+			token.length = static_cast<uint16_t>(lexeme.length);
+		}
+		token.value = 0;
+		if (lexeme.type == TokenType::NUMBER)
+		{
+			// Literals past INT_MAX are left without a value; the parser
+			// rejects them as std::stoi did.
+			int64_t value = 0;
+			size_t i = 0;
+			for (; i < lexeme.length && value <= INT_MAX; i++)
+			{
+				value = value * 10 + (input[lexeme.offset + i] - '0');
+			}
+			if (value <= INT_MAX)
+			{
+				token.value = static_cast<int32_t>(value);
+				token.flags |= Token::HAS_VALUE;
+			}
+		}
+	}
+};
+
+// Parser class
+class Parser
+{
+private:
+	Lexer lexer;
+	Token currentToken;
+	Position current{1, 1};
+	// Scratch for variable names, kept to reuse its buffer.
+	std::string name;
+
+	void advance()
+	{
+		lexer.nextToken(currentToken);
+		current = lexer.position();
+	}
+
+	// Creates a node located at the token that starts it.
+	template <typename T, typename... Args>
+	std::shared_ptr<ASTNode> makeNode(const Position &at, Args &&...args)
+	{
+		stats::count(stats::NODES_CREATED);
+		alloc::NodeScope allocations(typeid(T));
+		auto node = std::make_shared<T>(std::forward<Args>(args)...);
+		node->line = at.line;
+		node->column = at.column;
+		return node;
+	}
+
+	const std::string &nameOf(const Token &token)
+	{
+		std::string_view text = lexer.text(token);
+		name.assign(text.data(), text.size());
+		return name;
+	}
+
+	void eat(TokenType type)
+	{
+		if (currentToken.type == type)
+		{
+			advance();
+		}
+		else
+		{
+			// '*' keeps the empty text it has always been reported with.
+			std::string_view text;
+			if (currentToken.type != TokenType::MULTIPLY)
+			{
+				text = lexer.text(currentToken);
+			}
+			throw ParseError("Unexpected token: " + std::string(text));
+		}
+	}
+
+	// Leaves currentToken in place until its node exists, so the name is
+	// read straight from the input.
+	std::shared_ptr<ASTNode> factor()
+	{
+		if (currentToken.type == TokenType::NUMBER)
+		{
+			if (!(currentToken.flags & Token::HAS_VALUE))
+			{
+				throw std::out_of_range("stoi");
+			}
+			auto node = makeNode<NumberNode>(current, static_cast<int>(currentToken.value));
+			eat(TokenType::NUMBER);
+			return node;
+		}
+
+		if (currentToken.type == TokenType::IDENTIFIER)
+		{
+			auto node = makeNode<VariableNode>(current, nameOf(currentToken));
+			eat(TokenType::IDENTIFIER);
+			return node;
+		}
+
+		if (currentToken.type == TokenType::LPAREN)
+		{
+			eat(TokenType::LPAREN);
+			auto node = expr();
+			eat(TokenType::RPAREN);
+			return node;
+		}
+
+		throw ParseError("Invalid factor");
+	}
+
+	std::shared_ptr<ASTNode> term()
+	{
+		auto node = factor();
+
+		while (currentToken.type == TokenType::MULTIPLY ||
+			   currentToken.type == TokenType::DIVIDE)
+		{
+			Token token = currentToken;
+			Position at = current;
+			if (token.type == TokenType::MULTIPLY)
+			{
+				eat(TokenType::MULTIPLY);
+			}
+			else
+			{
+				eat(TokenType::DIVIDE);
+			}
+			node = makeNode<BinaryOpNode>(at, node, token.type, factor());
+		}
+
+		return node;
+	}
+
+	std::shared_ptr<ASTNode> expr()
+	{
+		auto node = term();
+
+		while (currentToken.type == TokenType::PLUS ||
+			   currentToken.type == TokenType::MINUS)
+		{
+			Token token = currentToken;
+			Position at = current;
+			if (token.type == TokenType::PLUS)
+			{
+				eat(TokenType::PLUS);
+			}
+			else
+			{
+				eat(TokenType::MINUS);
+			}
+			node = makeNode<BinaryOpNode>(at, node, token.type, term());
+		}
+
+		return node;
+	}
+
+	std::shared_ptr<ASTNode> statement()
+	{
+		if (currentToken.type == TokenType::IF)
+		{
+			return ifStatement();
+		}
+
+		if (currentToken.type == TokenType::IDENTIFIER)
+		{
+			Token start = currentToken;
+			Position at = current;
+			eat(TokenType::IDENTIFIER);
+
+			if (currentToken.type == TokenType::ASSIGN)
+			{
+				eat(TokenType::ASSIGN);
+				auto value = expr();
+				return makeNode<AssignmentNode>(at, nameOf(start), value);
+			}
+
+			return makeNode<VariableNode>(at, nameOf(start));
+		}
+
+		return expr();
+	}
+
+	std::shared_ptr<ASTNode> ifStatement()
+	{
+		Position at = current;
+		eat(TokenType::IF);
+		auto condition = expr();
+		eat(TokenType::THEN);
+		auto thenBranch = statement();
 
 		std::shared_ptr<ASTNode> elseBranch = nullptr;
 		if (currentToken.type == TokenType::ELSE)
 		{
-			eat(TokenType::ELSE);
-			elseBranch = statement();
+			eat(TokenType::ELSE);
+			elseBranch = statement();
+		}
+
+		eat(TokenType::ENDIF);
+		return makeNode<IfNode>(at, condition, thenBranch, elseBranch);
+	}
+
+public:
+	Parser(const std::string &text) : lexer(text)
+	{
+		advance();
+	}
+
+	// Reuses this parser for new text. Nothing the parser owns is
+	// reallocated; the nodes of each tree are still allocated, as they
+	// belong to whoever holds the tree.
+	void reset(const std::string &text) { reset(text.data(), text.size()); }
+
+	void reset(const char *text, size_t size)
+	{
+		lexer.reset(text, size);
+		advance();
+	}
+
+	// Tokens are lexed on demand, so each parse span also covers the lexing
+	// of its statement; the span records how many tokens that was.
+	std::shared_ptr<ASTNode> parse()
+	{
+		stats::PhaseScope timer(stats::PARSE);
+		alloc::PhaseScope allocations(stats::PARSE);
+		trace::Span span("parse");
+		size_t before = lexer.tokenCount();
+		auto node = statement();
+		stats::count(stats::TOKENS, lexer.tokenCount() - before);
+		span.arg("tokens", static_cast<int64_t>(lexer.tokenCount() - before));
+		return node;
+	}
+
+	bool atEnd() const { return currentToken.type == TokenType::END; }
+
+	// Tokens lexed so far, including the one looked ahead at.
+	size_t tokenCount() const { return lexer.tokenCount(); }
+
+	// Parses statements until the end of the input.
+	std::vector<std::shared_ptr<ASTNode>> parseProgram()
+	{
+		std::vector<std::shared_ptr<ASTNode>> statements;
+		while (currentToken.type != TokenType::END)
+		{
+			statements.push_back(parse());
+		}
+		return statements;
+	}
+
+	int evaluate(std::shared_ptr<ASTNode> node)
+	{
+		stats::PhaseScope timer(stats::EVALUATE);
+		alloc::PhaseScope allocations(stats::EVALUATE);
+		trace::Span span("evaluate");
+		profile::Frame frame("statement");
+		return node->evaluate();
+	}
+
+	int evaluate(std::shared_ptr<ASTNode> node, EvalBudget &budget)
+	{
+		stats::PhaseScope timer(stats::EVALUATE);
+		alloc::PhaseScope allocations(stats::EVALUATE);
+		trace::Span span("evaluate");
+		profile::Frame frame("statement");
+		EvalBudget::Scope scope(budget);
+		return node->evaluate();
+	}
+};
+
+// Syntax checker
+// Runs the same grammar as Parser over a Scanner without building anything,
+// so checking an input allocates no memory. Errors go into a fixed array;
+// when collecting all of them the recognizer resynchronizes at the next line that
+// starts a statement and keeps going, otherwise it stops at the first.
+class Recognizer
+{
+public:
+	static constexpr size_t maxErrors = 16;
+
+	struct Error
+	{
+		const char *message;
+		size_t offset;
+		size_t length;
+		int line;
+		int column;
+	};
+
+private:
+	const char *data = nullptr;
+	size_t length = 0;
+	Scanner scanner;
+	Scanner::Lexeme current;
+	bool allErrors;
+	Error errors[maxErrors];
+	size_t errorTotal = 0;
+
+	void advance()
+	{
+		stats::count(stats::TOKENS);
+		scanner.next(data, length, current);
+	}
+
+	bool fail(const char *message)
+	{
+		if (errorTotal < maxErrors)
+		{
+			errors[errorTotal] = {message, current.offset, current.length, current.line, current.column};
+		}
+		errorTotal++;
+		return false;
+	}
+
+	bool check()
+	{
+		return current.type != TokenType::INVALID || fail("Invalid character");
+	}
+
+	bool eat(TokenType type)
+	{
+		if (!check())
+		{
+			return false;
+		}
+		if (current.type != type)
+		{
+			return fail("Unexpected token");
+		}
+		advance();
+		return true;
+	}
+
+	// Parser converts literals with std::stoi, which rejects anything past INT_MAX.
+	bool numberFits() const
+	{
+		size_t start = current.offset;
+		while (start + 1 < current.offset + current.length && data[start] == '0')
+		{
+			start++;
+		}
+		size_t digits = current.offset + current.length - start;
+		return digits < 10 || (digits == 10 && std::memcmp(data + start, "2147483647", 10) <= 0);
+	}
+
+	bool factor()
+	{
+		if (!check())
+		{
+			return false;
+		}
+		if (current.type == TokenType::NUMBER)
+		{
+			if (!numberFits())
+			{
+				return fail("Number out of range");
+			}
+			advance();
+			return true;
+		}
+		if (current.type == TokenType::IDENTIFIER)
+		{
+			advance();
+			return true;
+		}
+		if (current.type == TokenType::LPAREN)
+		{
+			advance();
+			return expr() && eat(TokenType::RPAREN);
+		}
+		return fail("Invalid factor");
+	}
+
+	bool term()
+	{
+		if (!factor())
+		{
+			return false;
+		}
+		while (current.type == TokenType::MULTIPLY || current.type == TokenType::DIVIDE)
+		{
+			advance();
+			if (!factor())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool expr()
+	{
+		if (!term())
+		{
+			return false;
+		}
+		while (current.type == TokenType::PLUS || current.type == TokenType::MINUS)
+		{
+			advance();
+			if (!term())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool statement()
+	{
+		if (!check())
+		{
+			return false;
+		}
+		if (current.type == TokenType::IF)
+		{
+			advance();
+			if (!expr() || !eat(TokenType::THEN) || !statement())
+			{
+				return false;
+			}
+			if (current.type == TokenType::ELSE)
+			{
+				advance();
+				if (!statement())
+				{
+					return false;
+				}
+			}
+			return eat(TokenType::ENDIF);
+		}
+		if (current.type == TokenType::IDENTIFIER)
+		{
+			advance();
+			if (current.type == TokenType::ASSIGN)
+			{
+				advance();
+				return expr();
+			}
+			return true;
+		}
+		return expr();
+	}
+
+	// Skips to the first token on a later line that can start a statement.
+	void recover()
+	{
+		int line = current.line;
+		do
+		{
+			advance();
+		} while (current.type != TokenType::END &&
+				 (current.line == line || (current.type != TokenType::IDENTIFIER && current.type != TokenType::IF)));
+	}
+
+	void start(const char *text, size_t size)
+	{
+		data = text;
+		length = size;
+		scanner = Scanner();
+		errorTotal = 0;
+		advance();
+	}
+
+public:
+	Recognizer(bool collectAll = false) : allErrors(collectAll) {}
+
+	// Checks a whole program; true if it would parse.
+	bool recognize(const char *text, size_t size)
+	{
+		stats::PhaseScope timer(stats::PARSE);
+		trace::Span span("recognize");
+		start(text, size);
+
+		while (current.type != TokenType::END)
+		{
+			if (!statement())
+			{
+				if (!allErrors)
+				{
+					break;
+				}
+				recover();
+			}
+		}
+		return errorTotal == 0;
+	}
+
+	bool recognize(const std::string &text) { return recognize(text.data(), text.size()); }
+
+	// Checks one statement as Parser::parse does: the input must hold one,
+	// and only the token looked ahead at after it is read.
+	bool recognizeStatement(const char *text, size_t size)
+	{
+		stats::PhaseScope timer(stats::PARSE);
+		trace::Span span("recognize");
+		start(text, size);
+		return statement() && check();
+	}
+
+	bool recognizeStatement(const std::string &text) { return recognizeStatement(text.data(), text.size()); }
+
+	// Errors found, including any beyond the first maxErrors.
+	size_t errorCount() const { return errorTotal; }
+	const Error &error(size_t index) const { return errors[index]; }
+	size_t storedErrors() const { return std::min(errorTotal, maxErrors); }
+
+	// Formats an error with the offending text and its position; only valid
+	// while the checked text is.
+	std::string describe(size_t index) const
+	{
+		const Error &e = errors[index];
+		std::string text = e.message;
+		if (e.length > 0)
+		{
+			text += ": " + std::string(data + e.offset, e.length);
+		}
+		return text + " at line " + std::to_string(e.line) + ", column " + std::to_string(e.column);
+	}
+};
+
+// One-pass evaluation
+// Parses with the Parser grammar and evaluates each production as it is
+// reduced, so values live on the call stack and memory grows with nesting
+// depth only. The branch of an if that is not taken is still parsed, but
+// nothing in it is evaluated, looked up or assigned. Because nothing is
+// deferred, an evaluation error can surface before a syntax error further
+// on, and earlier statements of a program have already run by then.
+class OnePassEvaluator : private TokenCursor
+{
+private:
+	int variable(const Scanner::Lexeme &at, bool live)
+	{
+		if (!live)
+		{
+			return 0;
+		}
+		countEvaluation();
+		int value;
+		if (!slot(at)->load(value))
+		{
+			throw UndefinedVariableError(name);
+		}
+		return value;
+	}
+
+	int factor(bool live)
+	{
+		if (current.type == TokenType::NUMBER)
+		{
+			int value = number();
+			if (live)
+			{
+				countEvaluation();
+			}
+			advance();
+			return value;
+		}
+		if (current.type == TokenType::IDENTIFIER)
+		{
+			int value = variable(current, live);
+			advance();
+			return value;
+		}
+		if (current.type == TokenType::LPAREN)
+		{
+			advance();
+			int value = expr(live);
+			eat(TokenType::RPAREN);
+			return value;
+		}
+		throw ParseError("Invalid factor");
+	}
+
+	int term(bool live)
+	{
+		int value = factor(live);
+		while (current.type == TokenType::MULTIPLY || current.type == TokenType::DIVIDE)
+		{
+			TokenType op = current.type;
+			advance();
+			int right = factor(live);
+			if (live)
+			{
+				countEvaluation();
+				value = BinaryOpNode::apply(op, value, right);
+			}
+		}
+		return value;
+	}
+
+	int expr(bool live)
+	{
+		int value = term(live);
+		while (current.type == TokenType::PLUS || current.type == TokenType::MINUS)
+		{
+			TokenType op = current.type;
+			advance();
+			int right = term(live);
+			if (live)
+			{
+				countEvaluation();
+				value = BinaryOpNode::apply(op, value, right);
+			}
+		}
+		return value;
+	}
+
+	int statement(bool live)
+	{
+		if (current.type == TokenType::IF)
+		{
+			advance();
+			int condition = expr(live);
+			if (live)
+			{
+				countEvaluation();
+			}
+			eat(TokenType::THEN);
+			int result = statement(live && condition != 0);
+			if (current.type == TokenType::ELSE)
+			{
+				advance();
+				int otherwise = statement(live && condition == 0);
+				if (condition == 0)
+				{
+					result = otherwise;
+				}
+			}
+			else if (condition == 0)
+			{
+				result = 0;
+			}
+			eat(TokenType::ENDIF);
+			return result;
+		}
+
+		if (current.type == TokenType::IDENTIFIER)
+		{
+			Scanner::Lexeme target = current;
+			advance();
+			if (current.type == TokenType::ASSIGN)
+			{
+				advance();
+				int value = expr(live);
+				if (live)
+				{
+					countEvaluation();
+					slot(target)->store(value);
+				}
+				return value;
+			}
+
+			// A bare name ends the statement, exactly as in Parser.
+			return variable(target, live);
+		}
+
+		return expr(live);
+	}
+
+public:
+	// The text is read in place and must outlive the evaluator.
+	OnePassEvaluator(const char *text, size_t size) : TokenCursor(text, size) {}
+
+	OnePassEvaluator(const std::string &text) : OnePassEvaluator(text.data(), text.size()) {}
+
+	void reset(const char *text, size_t size) { restart(text, size); }
+	void reset(const std::string &text) { restart(text.data(), text.size()); }
+
+	bool atEnd() const { return current.type == TokenType::END; }
+
+	// Evaluates the next statement, like Parser::parse followed by evaluate.
+	int evaluate()
+	{
+		stats::PhaseScope timer(stats::EVALUATE);
+		alloc::PhaseScope allocations(stats::EVALUATE);
+		trace::Span span("one-pass");
+		return statement(true);
+	}
+
+	int evaluate(EvalBudget &budget)
+	{
+		EvalBudget::Scope scope(budget);
+		return evaluate();
+	}
+
+	// Evaluates statements until the end of the input; returns the last value.
+	int evaluateProgram()
+	{
+		int result = 0;
+		while (!atEnd())
+		{
+			result = evaluate();
+		}
+		return result;
+	}
+};
+
+// Direct bytecode compiler
+// Parser's grammar over a Scanner, emitting code as each production is
+// reduced instead of building a tree first. Forward jumps around if
+// branches are back-patched once the branch has been compiled.
+class Compiler : private TokenCursor
+{
+private:
+	Bytecode *code = nullptr;
+
+	void factor()
+	{
+		if (current.type == TokenType::NUMBER)
+		{
+			code->emit(Bytecode::Op::PUSH, number());
+			advance();
+			return;
+		}
+		if (current.type == TokenType::IDENTIFIER)
+		{
+			code->emit(Bytecode::Op::LOAD, code->slot(slot(current)));
+			advance();
+			return;
+		}
+		if (current.type == TokenType::LPAREN)
+		{
+			advance();
+			expr();
+			eat(TokenType::RPAREN);
+			return;
+		}
+		throw ParseError("Invalid factor");
+	}
+
+	void term()
+	{
+		factor();
+		while (current.type == TokenType::MULTIPLY || current.type == TokenType::DIVIDE)
+		{
+			TokenType op = current.type;
+			advance();
+			factor();
+			code->emitBinary(op);
+		}
+	}
+
+	void expr()
+	{
+		term();
+		while (current.type == TokenType::PLUS || current.type == TokenType::MINUS)
+		{
+			TokenType op = current.type;
+			advance();
+			term();
+			code->emitBinary(op);
+		}
+	}
+
+	void statement()
+	{
+		if (current.type == TokenType::IF)
+		{
+			advance();
+			expr();
+			eat(TokenType::THEN);
+			Bytecode::Branch branch = code->beginIf();
+			statement();
+			code->beginElse(branch);
+			bool hasElse = current.type == TokenType::ELSE;
+			if (hasElse)
+			{
+				advance();
+				statement();
+			}
+			eat(TokenType::ENDIF);
+			code->endIf(branch, hasElse);
+			return;
+		}
+
+		if (current.type == TokenType::IDENTIFIER)
+		{
+			Scanner::Lexeme target = current;
+			advance();
+			if (current.type == TokenType::ASSIGN)
+			{
+				advance();
+				expr();
+				code->emit(Bytecode::Op::STORE, code->slot(slot(target)));
+				return;
+			}
+
+			// A bare name ends the statement, exactly as in Parser.
+			code->emit(Bytecode::Op::LOAD, code->slot(slot(target)));
+			return;
+		}
+
+		expr();
+	}
+
+public:
+	// The text is read in place and must outlive the compiler.
+	Compiler(const char *text, size_t size) : TokenCursor(text, size) {}
+	Compiler(const std::string &text) : Compiler(text.data(), text.size()) {}
+
+	// Names the store has not registered get slots owned by environment, and
+	// the code must run with it; for requests from untrusted clients.
+	Compiler(const std::string &text, Environment &environment) : Compiler(text)
+	{
+		locals = &environment;
+	}
+
+	// Compiling into a cleared Bytecode after reset reuses its storage, so
+	// a warm Compiler, Bytecode and VirtualMachine never allocate.
+	void reset(const char *text, size_t size) { restart(text, size); }
+	void reset(const std::string &text) { restart(text.data(), text.size()); }
+
+	bool atEnd() const { return current.type == TokenType::END; }
+
+	// Appends the next statement to out, like Parser::parse.
+	void compile(Bytecode &out)
+	{
+		stats::PhaseScope timer(stats::COMPILE);
+		alloc::PhaseScope allocations(stats::COMPILE);
+		trace::Span span("compile");
+		size_t before = out.size();
+		code = &out;
+		out.beginStatement();
+		statement();
+		span.arg("instructions", static_cast<int64_t>(out.size() - before));
+	}
+
+	// Compiles statements until the end of the input.
+	Bytecode compileProgram()
+	{
+		Bytecode out;
+		while (!atEnd())
+		{
+			compile(out);
+		}
+		return out;
+	}
+};
+
+// Batch compilation
+// Compiles many small programs from one packed buffer into a single
+// Bytecode with one Compiler, so a whole request payload shares one
+// instruction array and one slot table and costs one call. Program i is
+// text[offsets[i], offsets[i + 1]). A program holds at least one
+// statement, so an empty one fails like Parser::parse on empty input. A
+// program that fails to compile leaves no code behind and keeps its error
+// message instead.
+class CompiledBatch
+{
+public:
+	struct Entry
+	{
+		uint32_t begin; // instruction range
+		uint32_t end;
+		int32_t error; // index into errors, or -1
+	};
+
+	Bytecode code;
+	std::vector<Entry> entries;
+	std::vector<std::string> errors;
+
+	void compile(const char *text, const uint32_t *offsets, size_t count)
+	{
+		trace::Span span("compile batch");
+		span.arg("programs", static_cast<int64_t>(count));
+		code.clear();
+		entries.clear();
+		errors.clear();
+		entries.reserve(count);
+
+		Compiler compiler("");
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t begin = code.size();
+			size_t slots = code.slots.size();
+			Entry entry{static_cast<uint32_t>(begin), 0, -1};
+			try
+			{
+				code.beginProgram();
+				compiler.reset(text + offsets[i], offsets[i + 1] - offsets[i]);
+				do
+				{
+					compiler.compile(code);
+				} while (!compiler.atEnd());
+			}
+			catch (const std::exception &e)
+			{
+				code.truncate(begin, slots);
+				entry.error = static_cast<int32_t>(errors.size());
+				errors.push_back(e.what());
+			}
+			entry.end = static_cast<uint32_t>(code.size());
+			entries.push_back(entry);
+		}
+	}
+
+	void compile(const std::string &text, const std::vector<uint32_t> &offsets)
+	{
+		compile(text.data(), offsets.data(), offsets.empty() ? 0 : offsets.size() - 1);
+	}
+
+	size_t size() const { return entries.size(); }
+
+	EvalOutcome run(VirtualMachine &machine, size_t index) const
+	{
+		EvalOutcome outcome;
+		const Entry &entry = entries[index];
+		if (entry.error >= 0)
+		{
+			outcome.error = errors[static_cast<size_t>(entry.error)];
+			return outcome;
+		}
+		try
+		{
+			outcome.value = machine.run(code, entry.begin, entry.end);
+			outcome.ok = true;
+		}
+		catch (const std::exception &e)
+		{
+			outcome.error = e.what();
+		}
+		return outcome;
+	}
+
+	void runAll(VirtualMachine &machine, std::vector<EvalOutcome> &outcomes) const
+	{
+		outcomes.resize(entries.size());
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			outcomes[i] = run(machine, i);
+		}
+	}
+};
+
+// 64-bit FNV-1a
+// Depends only on the bytes fed in, never on addresses, so values are the
+// same in every run and every process.
+struct Fnv1a
+{
+	uint64_t value = 14695981039346656037ull;
+
+	void add(const void *data, size_t size)
+	{
+		const unsigned char *bytes = static_cast<const unsigned char *>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			value ^= bytes[i];
+			value *= 1099511628211ull;
+		}
+	}
+
+	// Little-endian whatever the host, to keep hashes portable.
+	void add(uint64_t word)
+	{
+		unsigned char bytes[8];
+		for (int i = 0; i < 8; i++)
+		{
+			bytes[i] = static_cast<unsigned char>(word >> (8 * i));
+		}
+		add(bytes, sizeof(bytes));
+	}
+};
+
+// Canonical expression pool
+// Hash-conses trees into a canonical form. Chains of + and of * are
+// flattened and their operands put in a fixed order, and parentheses and
+// whitespace never reach the tree in the first place, so x+y, (y) + x and
+// y + x all become one node. Structurally equal canonical subtrees are
+// always the same node, which makes the parts that different statements
+// have in common shared storage. A shared node keeps the position of its
+// first occurrence. Reordering operands only changes which error is
+// reported when more than one operand would fail.
+class ExpressionPool
+{
+public:
+	ExpressionPool() = default;
+	ExpressionPool(const ExpressionPool &) = delete;
+	ExpressionPool &operator=(const ExpressionPool &) = delete;
+
+	std::shared_ptr<ASTNode> intern(const std::shared_ptr<ASTNode> &node)
+	{
+		return node->canonical(*this);
+	}
+
+	std::shared_ptr<ASTNode> number(int value, const ASTNode &at)
+	{
+		Key key(Kind::NUMBER);
+		key.value = value;
+		return find<NumberNode>(std::move(key), at, value);
+	}
+
+	std::shared_ptr<ASTNode> variable(const std::string &name, const ASTNode &at)
+	{
+		Key key(Kind::VARIABLE);
+		key.name = name;
+		return find<VariableNode>(std::move(key), at, name);
+	}
+
+	std::shared_ptr<ASTNode> binary(TokenType op, std::shared_ptr<ASTNode> left, std::shared_ptr<ASTNode> right,
+									const ASTNode &at)
+	{
+		Key key(Kind::BINARY);
+		key.op = op;
+		key.children[0] = left.get();
+		key.children[1] = right.get();
+		return find<BinaryOpNode>(std::move(key), at, left, op, right);
+	}
+
+	std::shared_ptr<ASTNode> assignment(const std::string &name, std::shared_ptr<ASTNode> value, const ASTNode &at)
+	{
+		Key key(Kind::ASSIGN);
+		key.name = name;
+		key.children[0] = value.get();
+		return find<AssignmentNode>(std::move(key), at, name, value);
+	}
+
+	std::shared_ptr<ASTNode> branch(std::shared_ptr<ASTNode> condition, std::shared_ptr<ASTNode> thenBranch,
+									std::shared_ptr<ASTNode> elseBranch, const ASTNode &at)
+	{
+		Key key(Kind::IF);
+		key.children[0] = condition.get();
+		key.children[1] = thenBranch.get();
+		key.children[2] = elseBranch.get();
+		return find<IfNode>(std::move(key), at, condition, thenBranch, elseBranch);
+	}
+
+	// Stable hash of a canonical node.
+	uint64_t hash(const ASTNode *node) const { return entry(node).hash; }
+
+	// Order of commutative operands: by hash, then by text.
+	bool before(const ASTNode *a, const ASTNode *b) const
+	{
+		uint64_t ha = hash(a);
+		uint64_t hb = hash(b);
+		if (ha != hb)
+		{
+			return ha < hb;
+		}
+		return a != b && text(a) < text(b);
+	}
+
+	// Source text of a canonical statement, with single spaces and only the
+	// parentheses it needs. Parsing it gives back the same canonical node.
+	std::string text(const ASTNode *node) const
+	{
+		std::string out;
+		writeStatement(node, out);
+		return out;
+	}
+
+	size_t size() const { return entries.size(); }
+
+	void clear()
+	{
+		byHash.clear();
+		byNode.clear();
+		entries.clear();
+	}
+
+private:
+	enum class Kind : uint8_t
+	{
+		NUMBER,
+		VARIABLE,
+		BINARY,
+		ASSIGN,
+		IF
+	};
+
+	struct Key
+	{
+		Kind kind;
+		TokenType op = TokenType::END;
+		int value = 0;
+		std::string name;
+		const ASTNode *children[3] = {};
+
+		explicit Key(Kind k) : kind(k) {}
+
+		bool operator==(const Key &other) const
+		{
+			return kind == other.kind && op == other.op && value == other.value && name == other.name &&
+				   std::equal(children, children + 3, other.children);
+		}
+	};
+
+	struct Entry
+	{
+		Key key;
+		uint64_t hash;
+		std::shared_ptr<ASTNode> node;
+	};
+
+	std::vector<Entry> entries;
+	std::unordered_multimap<uint64_t, size_t> byHash;
+	std::unordered_map<const ASTNode *, size_t> byNode;
+
+	const Entry &entry(const ASTNode *node) const
+	{
+		auto found = byNode.find(node);
+		if (found == byNode.end())
+		{
+			throw std::logic_error("Node is not in the pool");
+		}
+		return entries[found->second];
+	}
+
+	// Children are already canonical, so their hashes stand in for them.
+	uint64_t hashOf(const Key &key) const
+	{
+		Fnv1a h;
+		unsigned char header[2] = {static_cast<unsigned char>(key.kind), static_cast<unsigned char>(key.op)};
+		h.add(header, sizeof(header));
+		h.add(static_cast<uint64_t>(static_cast<uint32_t>(key.value)));
+		h.add(key.name.data(), key.name.size() + 1);
+		for (const ASTNode *child : key.children)
+		{
+			h.add(child ? hash(child) : 0);
+		}
+		return h.value;
+	}
+
+	template <typename T, typename... Args>
+	std::shared_ptr<ASTNode> find(Key key, const ASTNode &at, Args &&...args)
+	{
+		uint64_t h = hashOf(key);
+		auto range = byHash.equal_range(h);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (entries[it->second].key == key)
+			{
+				return entries[it->second].node;
+			}
+		}
+
+		stats::count(stats::NODES_CREATED);
+		std::shared_ptr<ASTNode> node;
+		{
+			alloc::NodeScope allocations(typeid(T));
+			node = std::make_shared<T>(std::forward<Args>(args)...);
+		}
+		node->line = at.line;
+		node->column = at.column;
+		byHash.emplace(h, entries.size());
+		byNode.emplace(node.get(), entries.size());
+		entries.push_back({std::move(key), h, node});
+		return node;
+	}
+
+	static int precedence(TokenType op)
+	{
+		return op == TokenType::PLUS || op == TokenType::MINUS ? 1 : 2;
+	}
+
+	static const char *symbol(TokenType op)
+	{
+		switch (op)
+		{
+		case TokenType::PLUS:
+			return " + ";
+		case TokenType::MINUS:
+			return " - ";
+		case TokenType::MULTIPLY:
+			return " * ";
+		default:
+			return " / ";
+		}
+	}
+
+	// A statement that starts with a name is read as a bare variable (or an
+	// assignment), so an expression statement that would is parenthesized.
+	void writeStatement(const ASTNode *node, std::string &out) const
+	{
+		const Key &key = entry(node).key;
+		if (key.kind == Kind::ASSIGN)
+		{
+			out += key.name;
+			out += " = ";
+			writeExpression(key.children[0], out);
+		}
+		else if (key.kind == Kind::IF)
+		{
+			out += "if ";
+			writeExpression(key.children[0], out);
+			out += " then ";
+			writeStatement(key.children[1], out);
+			if (key.children[2])
+			{
+				out += " else ";
+				writeStatement(key.children[2], out);
+			}
+			out += " endif";
+		}
+		else if (key.kind == Kind::BINARY && startsWithName(node))
+		{
+			out += '(';
+			writeExpression(node, out);
+			out += ')';
+		}
+		else
+		{
+			writeExpression(node, out);
+		}
+	}
+
+	void writeExpression(const ASTNode *node, std::string &out) const
+	{
+		const Key &key = entry(node).key;
+		switch (key.kind)
+		{
+		case Kind::NUMBER:
+			out += std::to_string(key.value);
+			break;
+		case Kind::VARIABLE:
+			out += key.name;
+			break;
+		case Kind::BINARY:
+			writeOperand(key.children[0], key.op, false, out);
+			out += symbol(key.op);
+			writeOperand(key.children[1], key.op, true, out);
+			break;
+		default:
+			writeStatement(node, out);
+			break;
+		}
+	}
+
+	// Operators associate to the left, so a right operand of equal
+	// precedence needs parentheses and a left one does not.
+	void writeOperand(const ASTNode *node, TokenType parent, bool right, std::string &out) const
+	{
+		const Key &key = entry(node).key;
+		bool parenthesize = key.kind == Kind::BINARY &&
+							(precedence(key.op) < precedence(parent) ||
+							 (right && precedence(key.op) == precedence(parent)));
+		if (parenthesize)
+		{
+			out += '(';
+		}
+		writeExpression(node, out);
+		if (parenthesize)
+		{
+			out += ')';
+		}
+	}
+
+	bool startsWithName(const ASTNode *node) const
+	{
+		const Key *key = &entry(node).key;
+		while (key->kind == Kind::BINARY)
+		{
+			key = &entry(key->children[0]).key;
+		}
+		return key->kind == Kind::VARIABLE;
+	}
+};
+
+std::shared_ptr<ASTNode> NumberNode::canonical(ExpressionPool &pool) const
+{
+	return pool.number(value, *this);
+}
+
+std::shared_ptr<ASTNode> VariableNode::canonical(ExpressionPool &pool) const
+{
+	return pool.variable(name, *this);
+}
+
+// - and / keep their operand order; + and * chains are flattened and
+// rebuilt left-deep in canonical operand order.
+std::shared_ptr<ASTNode> BinaryOpNode::canonical(ExpressionPool &pool) const
+{
+	if (op != TokenType::PLUS && op != TokenType::MULTIPLY)
+	{
+		return pool.binary(op, left->canonical(pool), right->canonical(pool), *this);
+	}
+
+	std::vector<std::shared_ptr<ASTNode>> chain;
+	operands(op, pool, chain);
+	std::sort(chain.begin(), chain.end(),
+			  [&pool](const std::shared_ptr<ASTNode> &a, const std::shared_ptr<ASTNode> &b)
+			  { return pool.before(a.get(), b.get()); });
+	std::shared_ptr<ASTNode> node = chain[0];
+	for (size_t i = 1; i < chain.size(); i++)
+	{
+		node = pool.binary(op, node, chain[i], *this);
+	}
+	return node;
+}
+
+void BinaryOpNode::operands(TokenType chain, ExpressionPool &pool, std::vector<std::shared_ptr<ASTNode>> &out) const
+{
+	for (const ASTNode *side : {left.get(), right.get()})
+	{
+		const BinaryOpNode *inner = dynamic_cast<const BinaryOpNode *>(side);
+		if (inner && inner->op == chain)
+		{
+			inner->operands(chain, pool, out);
+		}
+		else
+		{
+			out.push_back(side->canonical(pool));
+		}
+	}
+}
+
+std::shared_ptr<ASTNode> AssignmentNode::canonical(ExpressionPool &pool) const
+{
+	return pool.assignment(name, value->canonical(pool), *this);
+}
+
+std::shared_ptr<ASTNode> IfNode::canonical(ExpressionPool &pool) const
+{
+	return pool.branch(condition->canonical(pool), thenBranch->canonical(pool),
+					   elseBranch ? elseBranch->canonical(pool) : nullptr, *this);
+}
+
+// Compile cache keyed by canonical form
+// Text seen before is found directly. New text is parsed and canonicalized,
+// and if an equivalent program was compiled before its code is shared, so
+// only programs that differ in substance are lowered. The cached code is
+// always that of the canonical form, whichever spelling came first. When
+// capacity distinct texts are held the cache starts over; code already
+// handed out stays valid. Not thread-safe: use one cache per thread.
+class CompileCache
+{
+public:
+	struct Counts
+	{
+		uint64_t textHits = 0;
+		uint64_t canonicalHits = 0;
+		uint64_t misses = 0;
+	};
+
+	explicit CompileCache(size_t capacity = 4096) : capacity(capacity) {}
+
+	// Throws the parser's errors, including for text with no statement;
+	// text that fails to parse is not cached.
+	std::shared_ptr<const Bytecode> compile(const std::string &text)
+	{
+		auto known = byText.find(text);
+		if (known != byText.end())
+		{
+			tally.textHits++;
+			return known->second;
+		}
+		if (byText.size() >= capacity)
+		{
+			clear();
+		}
+
+		parser.reset(text);
+		std::vector<std::shared_ptr<ASTNode>> statements;
+		do
+		{
+			statements.push_back(parser.parse());
+		} while (!parser.atEnd());
+
+		trace::Span span("canonicalize");
+		Fnv1a h;
+		std::vector<const ASTNode *> key;
+		key.reserve(statements.size());
+		for (std::shared_ptr<ASTNode> &statement : statements)
+		{
+			statement = pool.intern(statement);
+			key.push_back(statement.get());
+			h.add(pool.hash(statement.get()));
+		}
+
+		std::shared_ptr<const Bytecode> code;
+		auto range = programs.equal_range(h.value);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second.statements == key)
+			{
+				code = it->second.code;
+				break;
+			}
+		}
+		if (code)
+		{
+			tally.canonicalHits++;
+		}
+		else
+		{
+			tally.misses++;
+			code = std::make_shared<const Bytecode>(Bytecode::lower(statements));
+			programs.emplace(h.value, Program{std::move(key), code});
+		}
+		byText.emplace(text, code);
+		return code;
+	}
+
+	const Counts &counts() const { return tally; }
+	ExpressionPool &expressions() { return pool; }
+	size_t size() const { return byText.size(); }
+
+	void clear()
+	{
+		byText.clear();
+		programs.clear();
+		pool.clear();
+	}
+
+private:
+	struct Program
+	{
+		std::vector<const ASTNode *> statements;
+		std::shared_ptr<const Bytecode> code;
+	};
+
+	size_t capacity;
+	Parser parser{""};
+	ExpressionPool pool;
+	std::unordered_map<std::string, std::shared_ptr<const Bytecode>> byText;
+	std::unordered_multimap<uint64_t, Program> programs;
+	Counts tally;
+};
+
+// Source of variables that are not yet in the store
+class AsyncVariableProvider
+{
+public:
+	virtual ~AsyncVariableProvider() = default;
+	// Looks up a batch of names in one round trip; names the provider does
+	// not know are simply absent from results.
+	virtual void fetch(const std::vector<std::string> &names, std::map<std::string, int> &results) = 0;
+};
+
+// In-process stand-in for the external key-value store
+class LocalKeyValueStore : public AsyncVariableProvider
+{
+private:
+	std::map<std::string, int> data;
+	size_t batches = 0;
+
+public:
+	void put(const std::string &name, int value) { data[name] = value; }
+	size_t batchCount() const { return batches; }
+
+	// Reads name=value lines; blank lines are skipped.
+	void load(std::istream &in)
+	{
+		std::string line;
+		while (std::getline(in, line))
+		{
+			if (line.empty())
+			{
+				continue;
+			}
+			size_t eq = line.find('=');
+			if (eq == std::string::npos)
+			{
+				throw std::runtime_error("Expected name=value: " + line);
+			}
+			put(line.substr(0, eq), std::stoi(line.substr(eq + 1)));
+		}
+	}
+
+	void fetch(const std::vector<std::string> &names, std::map<std::string, int> &results) override
+	{
+		batches++;
+		for (const std::string &name : names)
+		{
+			auto it = data.find(name);
+			if (it != data.end())
+			{
+				results[name] = it->second;
+			}
+		}
+	}
+};
+
+// Evaluation with variables fetched on demand
+// Runs many programs interleaved on one thread, each as a resumable virtual
+// machine frame. A program that loads a variable the store does not have is
+// suspended at that load; once every program has either finished or
+// suspended, the outstanding names are fetched from the provider in a single
+// batch and the waiting programs resumed. Fetched values go into the
+// environment of the program that asked for them, never into the shared
+// store, so they last for that one evaluation.
+class AsyncEvaluator
+{
+public:
+	using Outcome = EvalOutcome;
+
+	AsyncEvaluator(AsyncVariableProvider &p) : provider(p) {}
+
+	// Compiles source now; a program that does not compile, or holds no
+	// statement, fails in run().
+	size_t submit(const std::string &source)
+	{
+		Pending pending;
+		try
+		{
+			Compiler compiler(source);
+			do
+			{
+				compiler.compile(pending.code);
+			} while (!compiler.atEnd());
+		}
+		catch (const std::exception &e)
+		{
+			pending.error = e.what();
+		}
+		programs.push_back(std::move(pending));
+		return programs.size() - 1;
+	}
+
+	std::vector<Outcome> run()
+	{
+		std::vector<Outcome> outcomes(programs.size());
+		std::vector<VirtualMachine::Frame> frames(programs.size());
+		std::vector<size_t> active;
+		for (size_t i = 0; i < programs.size(); i++)
+		{
+			if (programs[i].error.empty())
+			{
+				active.push_back(i);
+			}
+			else
+			{
+				outcomes[i].error = programs[i].error;
+			}
+		}
+
+		std::vector<size_t> waiting;
+		std::vector<std::string> names;
+		std::map<std::string, int> results;
+		while (!active.empty())
+		{
+			waiting.clear();
+			for (size_t i : active)
+			{
+				try
+				{
+					if (machine.resume(programs[i].code, frames[i]))
+					{
+						outcomes[i].value = frames[i].result;
+						outcomes[i].ok = true;
+					}
+					else
+					{
+						waiting.push_back(i);
+					}
+				}
+				catch (const std::exception &e)
+				{
+					outcomes[i].error = e.what();
+				}
+			}
+			if (waiting.empty())
+			{
+				break;
+			}
+
+			names.clear();
+			for (size_t i : waiting)
+			{
+				const std::string &name = *frames[i].missing->name.load(std::memory_order_acquire);
+				if (std::find(names.begin(), names.end(), name) == names.end())
+				{
+					names.push_back(name);
+				}
+			}
+			results.clear();
+			provider.fetch(names, results);
+			batches++;
+
+			active.clear();
+			for (size_t i : waiting)
+			{
+				const std::string &name = *frames[i].missing->name.load(std::memory_order_acquire);
+				auto it = results.find(name);
+				if (it == results.end())
+				{
+					outcomes[i].error = UndefinedVariableError(name).what();
+					continue;
+				}
+				frames[i].environment.set(frames[i].missing, it->second);
+				active.push_back(i);
+			}
+		}
+		programs.clear();
+		return outcomes;
+	}
+
+	// Provider round trips made so far.
+	size_t fetchBatches() const { return batches; }
+
+private:
+	struct Pending
+	{
+		Bytecode code;
+		std::string error;
+	};
+
+	AsyncVariableProvider &provider;
+	VirtualMachine machine;
+	std::vector<Pending> programs;
+	size_t batches = 0;
+};
+
+// Compiled script, immutable once published
+struct Script
+{
+	std::string source;
+	Bytecode code;
+};
+
+// Epoch-based read-copy-update domain
+// Readers announce the epoch they entered in a per-thread record and never
+// touch a reference count. Writers retire old objects tagged with the epoch
+// of their removal and free them once no reader is still inside an older
+// epoch; reclamation is attempted opportunistically and never blocks readers.
+// Each thread holds a separate record, with its own nesting depth, in every
+// domain it reads through. A domain must outlive the read sections entered
+// in it; threads that outlive the domain simply drop their registration.
+class RcuDomain
+{
+public:
+	static constexpr size_t maxReaders = 128;
+	static constexpr size_t maxDomainsPerThread = 8;
+
+	class ReadGuard
+	{
+	private:
+		RcuDomain &domain;
+
+	public:
+		ReadGuard(RcuDomain &d) : domain(d) { domain.enter(); }
+		~ReadGuard() { domain.exit(); }
+		ReadGuard(const ReadGuard &) = delete;
+		ReadGuard &operator=(const ReadGuard &) = delete;
+	};
+
+	RcuDomain() : id(nextId().fetch_add(1, std::memory_order_relaxed))
+	{
+		std::lock_guard<std::mutex> lock(registryMutex());
+		liveDomains().push_back(id);
+	}
+
+	RcuDomain(const RcuDomain &) = delete;
+	RcuDomain &operator=(const RcuDomain &) = delete;
+
+	~RcuDomain()
+	{
+		{
+			std::lock_guard<std::mutex> lock(registryMutex());
+			std::vector<uint64_t> &live = liveDomains();
+			live.erase(std::find(live.begin(), live.end(), id));
+		}
+		for (Retired &r : retired)
+		{
+			r.reclaim(r.object);
+		}
+	}
+
+	template <typename T>
+	void retire(const T *object)
+	{
+		if (object == nullptr)
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock(writerMutex);
+		uint64_t removedAt = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+		retired.push_back({object, removedAt, [](const void *p)
+						   { delete static_cast<const T *>(p); }});
+		reclaimLocked();
+	}
+
+	// Frees every retired object no reader can still observe.
+	void tryReclaim()
+	{
+		std::lock_guard<std::mutex> lock(writerMutex);
+		reclaimLocked();
+	}
+
+	// Blocks the calling writer until all current retirees are freed.
+	void synchronize()
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> lock(writerMutex);
+				reclaimLocked();
+				if (retired.empty())
+				{
+					return;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	// Objects retired but not yet freed.
+	size_t pending()
+	{
+		std::lock_guard<std::mutex> lock(writerMutex);
+		return retired.size();
+	}
+
+private:
+	struct alignas(64) ReaderRecord
+	{
+		std::atomic<uint64_t> epoch{0};
+		std::atomic<bool> inUse{false};
+	};
+
+	struct Retired
+	{
+		const void *object;
+		uint64_t removedAt;
+		void (*reclaim)(const void *);
+	};
+
+	// A thread's registration in one domain. The id tells a live domain
+	// from a destroyed one that left its address to a new domain.
+	struct Registration
+	{
+		RcuDomain *domain = nullptr;
+		uint64_t id = 0;
+		size_t index = 0;
+		int nesting = 0;
+	};
+
+	// Registrations of one thread, released when the thread exits.
+	struct ThreadState
+	{
+		Registration registrations[maxDomainsPerThread];
+
+		~ThreadState()
+		{
+			std::lock_guard<std::mutex> lock(registryMutex());
+			for (Registration &r : registrations)
+			{
+				if (r.domain != nullptr && alive(r.id))
+				{
+					r.domain->readers[r.index].inUse.store(false, std::memory_order_release);
+				}
+			}
+		}
+	};
+
+	const uint64_t id;
+	std::atomic<uint64_t> epoch{1};
+	ReaderRecord readers[maxReaders];
+	std::mutex writerMutex;
+	std::vector<Retired> retired;
+
+	static std::atomic<uint64_t> &nextId()
+	{
+		static std::atomic<uint64_t> counter{1};
+		return counter;
+	}
+
+	static std::mutex &registryMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	// Ids of the domains that exist; guarded by registryMutex.
+	static std::vector<uint64_t> &liveDomains()
+	{
+		static std::vector<uint64_t> live;
+		return live;
+	}
+
+	static bool alive(uint64_t domainId)
+	{
+		const std::vector<uint64_t> &live = liveDomains();
+		return std::find(live.begin(), live.end(), domainId) != live.end();
+	}
+
+	Registration &registration()
+	{
+		thread_local ThreadState state;
+		Registration *unused = nullptr;
+		for (Registration &r : state.registrations)
+		{
+			if (r.domain == this && r.id == id)
+			{
+				return r;
+			}
+			if (r.domain == nullptr && unused == nullptr)
+			{
+				unused = &r;
+			}
+		}
+
+		if (unused == nullptr)
+		{
+			// Drop registrations in domains that have since been destroyed.
+			std::lock_guard<std::mutex> lock(registryMutex());
+			for (Registration &r : state.registrations)
+			{
+				if (r.nesting == 0 && !alive(r.id))
+				{
+					r = Registration();
+					if (unused == nullptr)
+					{
+						unused = &r;
+					}
+				}
+			}
+		}
+		if (unused == nullptr)
+		{
+			throw std::runtime_error("Too many RCU domains on one thread");
+		}
+
+		for (size_t i = 0; i < maxReaders; i++)
+		{
+			bool expected = false;
+			if (readers[i].inUse.compare_exchange_strong(expected, true))
+			{
+				*unused = Registration{this, id, i, 0};
+				return *unused;
+			}
+		}
+		throw std::runtime_error("Too many RCU reader threads");
+	}
+
+	void enter()
+	{
+		Registration &r = registration();
+		if (r.nesting++ == 0)
+		{
+			readers[r.index].epoch.store(epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+		}
+	}
+
+	void exit()
+	{
+		Registration &r = registration();
+		if (--r.nesting == 0)
+		{
+			readers[r.index].epoch.store(0, std::memory_order_release);
+		}
+	}
+
+	void reclaimLocked()
+	{
+		if (retired.empty())
+		{
+			return;
+		}
+
+		uint64_t oldest = UINT64_MAX;
+		for (ReaderRecord &reader : readers)
+		{
+			uint64_t e = reader.epoch.load(std::memory_order_seq_cst);
+			if (e != 0 && e < oldest)
+			{
+				oldest = e;
+			}
+		}
+
+		size_t kept = 0;
+		for (Retired &r : retired)
+		{
+			if (r.removedAt <= oldest)
+			{
+				r.reclaim(r.object);
+			}
+			else
+			{
+				retired[kept++] = r;
+			}
+		}
+		retired.resize(kept);
+	}
+};
+
+// Hot-swappable script slot
+// Evaluations run against whichever version was current when they started;
+// load() compiles the new version off to the side and publishes it with a
+// single pointer exchange, so reloads never stall evaluating threads.
+class ScriptSlot
+{
+private:
+	RcuDomain &domain;
+	std::atomic<const Script *> current{nullptr};
+
+public:
+	ScriptSlot(RcuDomain &d) : domain(d) {}
+	ScriptSlot(const ScriptSlot &) = delete;
+	ScriptSlot &operator=(const ScriptSlot &) = delete;
+
+	~ScriptSlot()
+	{
+		domain.retire(current.exchange(nullptr));
+	}
+
+	// Throws the compiler's errors and keeps the current version if the
+	// new source does not compile.
+	void load(const std::string &source)
+	{
+		std::unique_ptr<Script> script(new Script{source, Compiler(source).compileProgram()});
+		publish(script.release());
+	}
+
+	void publish(const Script *script)
+	{
+		const Script *old = current.exchange(script, std::memory_order_acq_rel);
+		domain.retire(old);
+	}
+
+	bool loaded() const { return current.load(std::memory_order_acquire) != nullptr; }
+
+	// Runs f on the current script inside a read-side critical section.
+	template <typename F>
+	auto read(F &&f)
+	{
+		RcuDomain::ReadGuard guard(domain);
+		const Script *script = current.load(std::memory_order_seq_cst);
+		if (script == nullptr)
+		{
+			throw std::runtime_error("No script loaded");
+		}
+		return f(*script);
+	}
+
+	int evaluate(VirtualMachine &machine)
+	{
+		return read([&machine](const Script &script)
+					{ return machine.run(script.code); });
+	}
+
+	int evaluate(VirtualMachine &machine, Environment &environment)
+	{
+		return read([&machine, &environment](const Script &script)
+					{ return machine.run(script.code, environment); });
+	}
+};
+
+#ifdef __linux__
+// Keeps a ScriptSlot in step with a file
+// A background thread checks the file's modification time and loads each
+// new version into the slot; evaluations are never paused for it. A version
+// that fails to compile is reported and the previous one stays in service.
+class ScriptReloader
+{
+private:
+	ScriptSlot &slot;
+	std::string path;
+	std::chrono::milliseconds interval;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+	struct timespec loadedAt = {};
+	size_t reloads = 0;
+	std::thread watcher;
+
+	bool changed(struct timespec &modified)
+	{
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+		{
+			return false;
+		}
+		modified = info.st_mtim;
+		return modified.tv_sec != loadedAt.tv_sec || modified.tv_nsec != loadedAt.tv_nsec;
+	}
+
+	void reload(const struct timespec &modified)
+	{
+		loadedAt = modified;
+		std::ifstream file(path);
+		std::stringstream contents;
+		contents << file.rdbuf();
+		slot.load(contents.str());
+		reloads++;
+	}
+
+	void watch()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!wake.wait_for(lock, interval, [this]
+							  { return stopping; }))
+		{
+			struct timespec modified;
+			if (!changed(modified))
+			{
+				continue;
+			}
+			try
+			{
+				reload(modified);
+			}
+			catch (const std::exception &e)
+			{
+				std::cerr << "Script " << path << " not reloaded: " << e.what() << std::endl;
+			}
+		}
+	}
+
+public:
+	// Loads the current version before returning; throws if it cannot.
+	ScriptReloader(ScriptSlot &s, const std::string &file,
+				   std::chrono::milliseconds every = std::chrono::milliseconds(500))
+		: slot(s), path(file), interval(every)
+	{
+		struct timespec modified;
+		if (!changed(modified))
+		{
+			throw std::runtime_error("Cannot read " + path);
+		}
+		reload(modified);
+		watcher = std::thread([this]
+							  { watch(); });
+	}
+
+	ScriptReloader(const ScriptReloader &) = delete;
+	ScriptReloader &operator=(const ScriptReloader &) = delete;
+
+	~ScriptReloader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		watcher.join();
+	}
+
+	size_t reloadCount()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return reloads;
+	}
+};
+#endif
+
+// Request priority classes, highest first
+enum class Priority
+{
+	INTERACTIVE,
+	BULK
+};
+
+// Priority and deadline-aware evaluation pool
+// Workers always drain the highest non-empty priority class first and, within
+// a class, run the request with the earliest deadline. Bulk work therefore only
+// runs on otherwise idle workers, and the interactive workers never take it at
+// all, so a pool saturated with bulk requests still answers interactive ones
+// at once. A request's deadline also bounds its evaluation through
+// EvalBudget, and requests already past their deadline when dequeued are
+// failed without being run.
+class RequestScheduler
+{
+public:
+	using Clock = EvalBudget::Clock;
+
+	// Evaluates one request on the worker's own VirtualMachine.
+	using Work = std::function<int(VirtualMachine &)>;
+	// Receives the value, or the exception the work threw.
+	using Completion = std::function<void(int, std::exception_ptr)>;
+
+	static constexpr size_t priorityClasses = 2;
+
+	// Starts workerCount general workers plus interactiveWorkers (at least
+	// one) that take only interactive requests.
+	RequestScheduler(size_t workerCount, size_t interactiveWorkers = 1)
+	{
+		interactiveWorkers = std::max<size_t>(interactiveWorkers, 1);
+		workerCount = std::max<size_t>(workerCount, 1);
+		for (size_t i = 0; i < interactiveWorkers + workerCount; i++)
+		{
+			size_t lowest = i < interactiveWorkers ? static_cast<size_t>(Priority::INTERACTIVE)
+												   : priorityClasses - 1;
+			workers.emplace_back([this, lowest]
+								 { workerLoop(lowest); });
+		}
+	}
+
+	RequestScheduler(const RequestScheduler &) = delete;
+	RequestScheduler &operator=(const RequestScheduler &) = delete;
+
+	// Finishes all queued requests, then stops the workers.
+	~RequestScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready.notify_all();
+		for (std::thread &worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	void submit(Work work, Priority priority, Completion done,
+				Clock::time_point deadline = Clock::time_point::max(),
+				uint64_t maxNodes = EvalBudget::unlimited)
+	{
+		auto request = std::unique_ptr<Request>(
+			new Request{std::move(work), std::move(done), deadline, maxNodes, 0});
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			request->sequence = nextSequence++;
+			auto &queue = queues[static_cast<size_t>(priority)];
+			queue.push_back(std::move(request));
+			std::push_heap(queue.begin(), queue.end(), LaterDeadline());
+		}
+		// Only some workers may take bulk work, so waking one is not enough.
+		ready.notify_all();
+	}
+
+	std::future<int> submit(const std::string &source, Priority priority,
+							Clock::time_point deadline = Clock::time_point::max(),
+							uint64_t maxNodes = EvalBudget::unlimited)
+	{
+		auto result = std::make_shared<std::promise<int>>();
+		submit([source](VirtualMachine &)
+			   {
+				   Parser parser(source);
+				   return parser.evaluate(parser.parse()); },
+			   priority,
+			   [result](int value, std::exception_ptr error)
+			   {
+				   if (error)
+				   {
+					   result->set_exception(error);
+				   }
+				   else
+				   {
+					   result->set_value(value);
+				   } },
+			   deadline, maxNodes);
+		return result->get_future();
+	}
+
+	size_t pending()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t total = 0;
+		for (auto &queue : queues)
+		{
+			total += queue.size();
+		}
+		return total;
+	}
+
+private:
+	struct Request
+	{
+		Work work;
+		Completion done;
+		Clock::time_point deadline;
+		uint64_t maxNodes;
+		uint64_t sequence;
+	};
+
+	// Heap order: earliest deadline on top, FIFO among equal deadlines.
+	struct LaterDeadline
+	{
+		bool operator()(const std::unique_ptr<Request> &a, const std::unique_ptr<Request> &b) const
+		{
+			if (a->deadline != b->deadline)
+			{
+				return a->deadline > b->deadline;
+			}
+			return a->sequence > b->sequence;
+		}
+	};
+
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::vector<std::unique_ptr<Request>> queues[priorityClasses];
+	std::vector<std::thread> workers;
+	uint64_t nextSequence = 0;
+	bool stopping = false;
+
+	// Takes from the classes up to and including lowest.
+	std::unique_ptr<Request> take(size_t lowest)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			for (size_t priority = 0; priority <= lowest; priority++)
+			{
+				auto &queue = queues[priority];
+				if (!queue.empty())
+				{
+					std::pop_heap(queue.begin(), queue.end(), LaterDeadline());
+					std::unique_ptr<Request> request = std::move(queue.back());
+					queue.pop_back();
+					return request;
+				}
+			}
+			if (stopping)
+			{
+				return nullptr;
+			}
+			ready.wait(lock);
+		}
+	}
+
+	static void run(Request &request, VirtualMachine &machine)
+	{
+		metrics::RequestTimer timer;
+		int value = 0;
+		std::exception_ptr error;
+		try
+		{
+			if (request.deadline != Clock::time_point::max() && Clock::now() >= request.deadline)
+			{
+				throw BudgetExceeded("Evaluation deadline exceeded before start");
+			}
+			EvalBudget budget(request.maxNodes, request.deadline);
+			EvalBudget::Scope scope(budget);
+			value = request.work(machine);
+			timer.finish(metrics::OK);
+		}
+		catch (const std::exception &e)
+		{
+			timer.finish(metrics::classify(e));
+			error = std::current_exception();
+		}
+		catch (...)
+		{
+			timer.finish(metrics::OTHER_ERROR);
+			error = std::current_exception();
+		}
+		request.done(value, error);
+	}
+
+	void workerLoop(size_t lowest)
+	{
+		VirtualMachine machine;
+		while (std::unique_ptr<Request> request = take(lowest))
+		{
+			run(*request, machine);
+		}
+	}
+};
+
+#ifdef __linux__
+// Shared-memory request/response ring for co-located clients
+// Clients claim slots in ring order with a fetch_add on head, fill in the
+// request and flip the slot state; the server walks the ring in the same
+// order, evaluates and flips the state back. Both sides spin briefly and
+// then sleep on the slot's state word with a futex; the waker only makes a
+// syscall when the sleeper has set the waiter bit. In busy-poll mode neither
+// side ever sleeps. Each slot records the pid holding it, so the server can
+// take back slots whose client died instead of waiting on them forever.
+namespace shm
+{
+	constexpr uint32_t magic = 0x52445031; // "RDP1"
+	constexpr size_t ringSize = 64;
+	constexpr size_t maxExpression = 256;
+	constexpr size_t maxBindings = 8;
+	constexpr size_t maxName = 32;
+	constexpr size_t maxError = 128;
+	constexpr int spinLimit = 2000;
+	constexpr std::chrono::milliseconds claimTimeout{250};
+
+	enum SlotState : uint32_t
+	{
+		FREE,
+		CLAIMED,
+		REQUEST,
+		DISPATCHED, // handed to a worker, response not yet written
+		RESPONSE
+	};
+
+	// A slot's state word holds the state in its low bits, the pid of the
+	// client holding the slot above them (Linux pids fit in 22 bits) and the
+	// waiter bit on top, so a claim publishes its owner in the same step.
+	constexpr uint32_t stateMask = 0xF;
+	constexpr int ownerShift = 4;
+	constexpr uint32_t waiterBit = 0x80000000u;
+
+	inline uint32_t stateOf(uint32_t word) { return word & stateMask; }
+	inline int32_t ownerOf(uint32_t word) { return static_cast<int32_t>((word & ~waiterBit) >> ownerShift); }
+	inline uint32_t held(uint32_t state, int32_t owner) { return state | static_cast<uint32_t>(owner) << ownerShift; }
+
+	struct Binding
+	{
+		char name[maxName];
+		int32_t value;
+	};
+
+	struct Request
+	{
+		char expression[maxExpression];
+		uint32_t priority;
+		uint32_t bindingCount;
+		Binding bindings[maxBindings];
+	};
+
+	struct Response
+	{
+		int32_t ok;
+		int32_t value;
+		char error[maxError];
+	};
+
+	struct alignas(64) Slot
+	{
+		std::atomic<uint32_t> state;
+		Request request;
+		Response response;
+	};
+
+	struct Region
+	{
+		uint32_t magic;
+		int32_t server; // pid of the serving process
+		std::atomic<uint32_t> stopping;
+		alignas(64) std::atomic<uint64_t> head;
+		Slot slots[ringSize];
+	};
+
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "futex word must be lock-free");
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+	inline void futexWait(std::atomic<uint32_t> &word, uint32_t expected, const timespec *timeout = nullptr)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+	}
+
+	inline void futexWakeAll(std::atomic<uint32_t> &word)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
+
+	inline void cpuRelax()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	enum class Wait
+	{
+		READY,
+		STOPPED,
+		TIMED_OUT
+	};
+
+	inline Wait waitUntil(Region &region, std::atomic<uint32_t> &word, uint32_t want, bool busyPoll,
+						  std::chrono::steady_clock::time_point deadline)
+	{
+		// Spinning before sleeping only pays off if the other side can run meanwhile.
+		static const int spinBudget = std::thread::hardware_concurrency() > 1 ? spinLimit : 0;
+		bool timed = deadline != std::chrono::steady_clock::time_point::max();
+
+		for (int spin = 0;; spin++)
+		{
+			uint32_t current = word.load(std::memory_order_acquire);
+			if (stateOf(current) == want)
+			{
+				return Wait::READY;
+			}
+			if (region.stopping.load(std::memory_order_relaxed))
+			{
+				return Wait::STOPPED;
+			}
+			std::chrono::nanoseconds left(0);
+			if (timed && (spin % 256 == 0 || !(busyPoll || spin < spinBudget)))
+			{
+				left = deadline - std::chrono::steady_clock::now();
+				if (left.count() <= 0)
+				{
+					return Wait::TIMED_OUT;
+				}
+			}
+			if (busyPoll || spin < spinBudget)
+			{
+				cpuRelax();
+				continue;
+			}
+			if (!(current & waiterBit) &&
+				!word.compare_exchange_weak(current, current | waiterBit, std::memory_order_acq_rel))
+			{
+				continue;
+			}
+			timespec timeout{static_cast<time_t>(left.count() / 1000000000),
+							 static_cast<long>(left.count() % 1000000000)};
+			futexWait(word, current | waiterBit, timed ? &timeout : nullptr);
+		}
+	}
+
+	inline bool processGone(int32_t pid)
+	{
+		return pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH);
+	}
+
+	// Moves a held slot to state, keeping its owner.
+	inline void setState(std::atomic<uint32_t> &word, uint32_t state)
+	{
+		uint32_t current = word.load(std::memory_order_relaxed);
+		while (!word.compare_exchange_weak(current, (current & ~(stateMask | waiterBit)) | state,
+										   std::memory_order_acq_rel))
+		{
+		}
+		if (current & waiterBit)
+		{
+			futexWakeAll(word);
+		}
+	}
+
+	// Gives a slot up; a FREE slot has no owner.
+	inline void release(std::atomic<uint32_t> &word)
+	{
+		if (word.exchange(FREE, std::memory_order_acq_rel) & waiterBit)
+		{
+			futexWakeAll(word);
+		}
+	}
+
+	// A region left behind by a server that died without unlinking it.
+	inline bool abandonedRegion(const std::string &name)
+	{
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd < 0)
+		{
+			return false;
+		}
+		struct stat info;
+		void *memory = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) == sizeof(Region))
+		{
+			memory = mmap(nullptr, sizeof(Region), PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (memory == MAP_FAILED)
+		{
+			return false;
+		}
+		const Region *region = static_cast<const Region *>(memory);
+		bool abandoned = region->magic == magic && processGone(region->server);
+		munmap(memory, sizeof(Region));
+		return abandoned;
+	}
+
+	// Creating never takes over an existing region unless its server is gone.
+	inline Region *mapRegion(const std::string &name, bool create)
+	{
+		int fd = shm_open(name.c_str(), create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+		if (fd < 0 && create && errno == EEXIST && abandonedRegion(name))
+		{
+			shm_unlink(name.c_str());
+			fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		}
+		if (fd < 0)
+		{
+			if (create && errno == EEXIST)
+			{
+				throw std::runtime_error("Shared memory region already in use: " + name);
+			}
+			throw std::runtime_error("Cannot open shared memory: " + name);
+		}
+		if (create && ftruncate(fd, sizeof(Region)) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("Cannot size shared memory: " + name);
+		}
+		void *memory = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (memory == MAP_FAILED)
+		{
+			throw std::runtime_error("Cannot map shared memory: " + name);
+		}
+		return static_cast<Region *>(memory);
+	}
+}
+
+// Server end of the shared-memory ring
+// The serving thread only walks the ring and hands each request, with its
+// priority, to a RequestScheduler; the worker that evaluates it writes the
+// response into the slot, so responses may complete out of ring order. Each
+// request is evaluated in its own Environment: its bindings shadow the
+// shared variables and its assignments are dropped with it.
+//
+// A slot whose request has not arrived within claimTimeout while later
+// tickets are out is skipped, and a slot held by a client that has died is
+// freed, so one dead client cannot stall the ring. A live client that
+// stalls for that long is served a lap later.
+class ShmServer
+{
+private:
+	std::string name;
+	shm::Region *region;
+	bool busyPoll;
+	ScriptSlot *script = nullptr;
+	// Declared last so it drains, still writing into the region, before the
+	// region is unmapped.
+	std::unique_ptr<RequestScheduler> scheduler;
+	std::atomic<uint64_t> skipped{0};
+
+	// Frees slot if its holder died; true if the server should move on.
+	bool abandoned(shm::Slot &slot, uint64_t tail)
+	{
+		if (region->head.load(std::memory_order_acquire) <= tail)
+		{
+			return false; // nobody has this ticket yet
+		}
+		uint32_t current = slot.state.load(std::memory_order_acquire);
+		switch (shm::stateOf(current))
+		{
+		case shm::FREE:
+			return true; // the ticket holder never claimed the slot
+		case shm::CLAIMED:
+		case shm::RESPONSE:
+			if (shm::processGone(shm::ownerOf(current)) &&
+				slot.state.compare_exchange_strong(current, shm::FREE, std::memory_order_acq_rel))
+			{
+				if (current & shm::waiterBit)
+				{
+					shm::futexWakeAll(slot.state);
+				}
+				return shm::stateOf(current) == shm::CLAIMED;
+			}
+			return false;
+		case shm::DISPATCHED:
+			return false; // in flight from the last lap; its response frees the slot
+		default:
+			return false;
+		}
+	}
+
+	void dispatch(shm::Slot &slot)
+	{
+		// Only the serving thread moves a slot out of REQUEST; the client may
+		// meanwhile set the waiter bit, which the completion needs to see.
+		shm::setState(slot.state, shm::DISPATCHED);
+
+		shm::Request &request = slot.request;
+		std::string expression(request.expression, strnlen(request.expression, shm::maxExpression));
+		uint32_t count = std::min<uint32_t>(request.bindingCount, shm::maxBindings);
+		std::vector<std::pair<std::string, int>> bindings;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			shm::Binding &binding = request.bindings[i];
+			bindings.push_back({std::string(binding.name, strnlen(binding.name, shm::maxName)), binding.value});
+		}
+		Priority priority = request.priority == static_cast<uint32_t>(Priority::BULK) ? Priority::BULK
+																					 : Priority::INTERACTIVE;
+		ScriptSlot *current = script;
+
+		scheduler->submit(
+			[expression, bindings, current](VirtualMachine &machine)
+			{
+				Environment environment(Environment::ISOLATED);
+				if (expression.empty() && current != nullptr)
+				{
+					bindAll(environment, bindings);
+					return current->evaluate(machine, environment);
+				}
+				// Names new to the store stay with the request, so clients
+				// cannot grow the shared store.
+				Bytecode program = Compiler(expression, environment).compileProgram();
+				bindAll(environment, bindings);
+				return machine.run(program, environment);
+			},
+			priority,
+			[&slot](int value, std::exception_ptr error)
+			{
+				shm::Response &response = slot.response;
+				response.ok = 1;
+				response.value = value;
+				response.error[0] = '\0';
+				if (error)
+				{
+					response.ok = 0;
+					response.value = 0;
+					try
+					{
+						std::rethrow_exception(error);
+					}
+					catch (const std::exception &e)
+					{
+						strncpy(response.error, e.what(), shm::maxError - 1);
+					}
+					catch (...)
+					{
+						strncpy(response.error, "Unknown error", shm::maxError - 1);
+					}
+					response.error[shm::maxError - 1] = '\0';
+				}
+				shm::setState(slot.state, shm::RESPONSE);
+			});
+	}
+
+	// Binding a name needs a compiled program that uses it; others are unused.
+	static void bindAll(Environment &environment, const std::vector<std::pair<std::string, int>> &bindings)
+	{
+		for (const auto &binding : bindings)
+		{
+			environment.bind(binding.first, binding.second);
+		}
+	}
+
+public:
+	// workers general workers evaluate requests, plus one reserved for
+	// interactive ones.
+	ShmServer(const std::string &regionName, bool poll = false,
+			  size_t workers = std::max(1u, std::thread::hardware_concurrency()))
+		: name(regionName), region(shm::mapRegion(regionName, true)), busyPoll(poll),
+		  scheduler(new RequestScheduler(workers))
+	{
+		new (region) shm::Region();
+		region->server = static_cast<int32_t>(getpid());
+		region->magic = shm::magic;
+	}
+
+	ShmServer(const ShmServer &) = delete;
+	ShmServer &operator=(const ShmServer &) = delete;
+
+	~ShmServer()
+	{
+		scheduler.reset();
+		munmap(region, sizeof(shm::Region));
+		shm_unlink(name.c_str());
+	}
+
+	// Requests with an empty expression then run the slot's current script.
+	void useScript(ScriptSlot &slot) { script = &slot; }
+
+	// Slots given up on because their client never finished the request.
+	uint64_t skippedSlots() const { return skipped.load(); }
+
+	// Hands requests to the workers in ring order until stop() is called. A
+	// slot still in flight from the last lap holds the ring until its
+	// response is collected and the next ticket's request arrives.
+	void serve()
+	{
+		for (uint64_t tail = 0;; tail++)
+		{
+			shm::Slot &slot = region->slots[tail % shm::ringSize];
+			for (;;)
+			{
+				// Only a slot that made no progress for a whole timeout is stuck.
+				uint32_t seen = slot.state.load(std::memory_order_acquire) & ~shm::waiterBit;
+				shm::Wait wait = shm::waitUntil(*region, slot.state, shm::REQUEST, busyPoll,
+												std::chrono::steady_clock::now() + shm::claimTimeout);
+				if (wait == shm::Wait::STOPPED)
+				{
+					return;
+				}
+				if (wait == shm::Wait::READY)
+				{
+					dispatch(slot);
+					break;
+				}
+				if ((slot.state.load(std::memory_order_acquire) & ~shm::waiterBit) == seen && abandoned(slot, tail))
+				{
+					skipped++;
+					break;
+				}
+			}
+		}
+	}
+
+	// Safe to call from another thread or a signal handler.
+	void stop()
+	{
+		region->stopping.store(1, std::memory_order_relaxed);
+		for (shm::Slot &slot : region->slots)
+		{
+			if (slot.state.load(std::memory_order_relaxed) & shm::waiterBit)
+			{
+				shm::futexWakeAll(slot.state);
+			}
+		}
+	}
+};
+
+// Client end of the shared-memory ring
+class ShmClient
+{
+private:
+	shm::Region *region;
+	bool busyPoll;
+
+	// Throws if the server stops, or its process dies, first.
+	void await(shm::Slot &slot, uint32_t state)
+	{
+		for (;;)
+		{
+			shm::Wait wait = shm::waitUntil(*region, slot.state, state, busyPoll,
+											std::chrono::steady_clock::now() + shm::claimTimeout);
+			if (wait == shm::Wait::READY)
+			{
+				return;
+			}
+			if (wait == shm::Wait::STOPPED || shm::processGone(region->server))
+			{
+				throw std::runtime_error("Shared-memory server stopped");
+			}
+		}
+	}
+
+public:
+	ShmClient(const std::string &regionName, bool poll = false)
+		: region(shm::mapRegion(regionName, false)), busyPoll(poll)
+	{
+		if (region->magic != shm::magic)
+		{
+			munmap(region, sizeof(shm::Region));
+			throw std::runtime_error("Shared memory region is not an evaluator ring: " + regionName);
+		}
+	}
+
+	ShmClient(const ShmClient &) = delete;
+	ShmClient &operator=(const ShmClient &) = delete;
+
+	~ShmClient()
+	{
+		munmap(region, sizeof(shm::Region));
+	}
+
+	int evaluate(const std::string &expression,
+				 const std::vector<std::pair<std::string, int>> &bindings = {},
+				 Priority priority = Priority::INTERACTIVE)
+	{
+		if (expression.size() >= shm::maxExpression)
+		{
+			throw std::runtime_error("Expression too long for shared-memory transport");
+		}
+		if (bindings.size() > shm::maxBindings)
+		{
+			throw std::runtime_error("Too many bindings for shared-memory transport");
+		}
+
+		uint64_t ticket = region->head.fetch_add(1, std::memory_order_relaxed);
+		shm::Slot &slot = region->slots[ticket % shm::ringSize];
+
+		// The slot may still be held by the client one lap behind us.
+		for (;;)
+		{
+			await(slot, shm::FREE);
+			uint32_t current = slot.state.load(std::memory_order_acquire);
+			if (shm::stateOf(current) == shm::FREE &&
+				slot.state.compare_exchange_strong(current, shm::held(shm::CLAIMED, getpid()),
+												   std::memory_order_acq_rel))
+			{
+				if (current & shm::waiterBit)
+				{
+					shm::futexWakeAll(slot.state);
+				}
+				break;
+			}
+		}
+
+		memcpy(slot.request.expression, expression.c_str(), expression.size() + 1);
+		slot.request.priority = static_cast<uint32_t>(priority);
+		slot.request.bindingCount = static_cast<uint32_t>(bindings.size());
+		for (size_t i = 0; i < bindings.size(); i++)
+		{
+			strncpy(slot.request.bindings[i].name, bindings[i].first.c_str(), shm::maxName - 1);
+			slot.request.bindings[i].name[shm::maxName - 1] = '\0';
+			slot.request.bindings[i].value = bindings[i].second;
+		}
+		shm::setState(slot.state, shm::REQUEST);
+
+		await(slot, shm::RESPONSE);
+		shm::Response response = slot.response;
+		shm::release(slot.state);
+
+		if (!response.ok)
+		{
+			throw std::runtime_error(response.error);
+		}
+		return response.value;
+	}
+};
+
+// Sharded batch evaluation across forked worker processes
+// Inputs are split into contiguous shards, one per worker, and streamed over
+// a socketpair; each worker answers in order, so the coordinator always knows
+// which input a crashed worker was on. That input is retried on a fresh
+// worker and reported as an error once it has crashed maxAttempts workers.
+// Every input is evaluated with an empty variable store, so results do not
+// depend on how the batch was partitioned. An input is either one statement
+// or a whole program, whose statements share variables and whose result is
+// that of the last one.
+class ShardCoordinator
+{
+public:
+	enum Unit
+	{
+		STATEMENT,
+		PROGRAM
+	};
+
+	ShardCoordinator(size_t workerCount, int maxAttempts = 2, Unit unit = STATEMENT)
+		: workerCount(std::max<size_t>(workerCount, 1)), maxAttempts(maxAttempts), unit(unit) {}
+
+	size_t restarts() const { return restartCount; }
+
+	std::vector<EvalOutcome> run(const std::vector<std::string> &inputs)
+	{
+		std::vector<EvalOutcome> outcomes(inputs.size());
+		std::vector<int> attempts(inputs.size(), 0);
+		std::vector<Worker> workers(std::min(workerCount, std::max<size_t>(inputs.size(), 1)));
+
+		size_t shardSize = (inputs.size() + workers.size() - 1) / workers.size();
+		for (size_t w = 0; w < workers.size(); w++)
+		{
+			for (size_t i = w * shardSize; i < std::min(inputs.size(), (w + 1) * shardSize); i++)
+			{
+				workers[w].assigned.push_back(i);
+			}
+			start(workers, w, inputs);
+		}
+
+		std::vector<pollfd> fds;
+		std::vector<size_t> owners;
+		for (;;)
+		{
+			fds.clear();
+			owners.clear();
+			for (size_t w = 0; w < workers.size(); w++)
+			{
+				if (workers[w].fd >= 0)
+				{
+					short events = POLLIN;
+					if (workers[w].sent < workers[w].outbox.size())
+					{
+						events |= POLLOUT;
+					}
+					fds.push_back({workers[w].fd, events, 0});
+					owners.push_back(w);
+				}
+			}
+			if (fds.empty())
+			{
+				break;
+			}
+			if (poll(fds.data(), fds.size(), -1) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				throw std::runtime_error("poll failed in shard coordinator");
+			}
+
+			for (size_t k = 0; k < fds.size(); k++)
+			{
+				Worker &worker = workers[owners[k]];
+				if (fds[k].revents & POLLOUT)
+				{
+					ssize_t n = send(worker.fd, worker.outbox.data() + worker.sent,
+									 worker.outbox.size() - worker.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+					if (n > 0)
+					{
+						worker.sent += static_cast<size_t>(n);
+					}
+				}
+				if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+				{
+					if (!receive(worker, outcomes))
+					{
+						finish(worker);
+						if (worker.answered < worker.assigned.size())
+						{
+							size_t culprit = worker.assigned[worker.answered];
+							if (++attempts[culprit] >= maxAttempts)
+							{
+								outcomes[culprit].error = "Worker crashed";
+								worker.answered++;
+							}
+						}
+						if (worker.answered < worker.assigned.size())
+						{
+							restartCount++;
+							start(workers, owners[k], inputs);
+						}
+					}
+				}
+			}
+		}
+		return outcomes;
+	}
+
+private:
+	static constexpr uint32_t endOfInput = UINT32_MAX;
+
+	struct Worker
+	{
+		pid_t pid = -1;
+		int fd = -1;
+		std::vector<size_t> assigned;
+		size_t answered = 0;
+		std::string outbox;
+		size_t sent = 0;
+		std::string inbox;
+	};
+
+	size_t workerCount;
+	int maxAttempts;
+	Unit unit;
+	size_t restartCount = 0;
+
+	static void appendWord(std::string &buffer, uint32_t word)
+	{
+		buffer.append(reinterpret_cast<const char *>(&word), sizeof(word));
+	}
+
+	static uint32_t readWord(const std::string &buffer, size_t offset)
+	{
+		uint32_t word;
+		memcpy(&word, buffer.data() + offset, sizeof(word));
+		return word;
+	}
+
+	static bool readFully(int fd, void *data, size_t size)
+	{
+		char *out = static_cast<char *>(data);
+		while (size > 0)
+		{
+			ssize_t n = recv(fd, out, size, 0);
+			if (n <= 0)
+			{
+				if (n < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			out += n;
+			size -= static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	static bool writeFully(int fd, const std::string &data)
+	{
+		size_t offset = 0;
+		while (offset < data.size())
+		{
+			ssize_t n = send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+			if (n <= 0)
+			{
+				if (n < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			offset += static_cast<size_t>(n);
+		}
+		return true;
+	}
+
+	// Request frame: index, length, source. Reply: index, ok, value, length, error.
+	[[noreturn]] static void workerMain(int fd, Unit unit)
+	{
+		std::string source;
+		std::string reply;
+		Parser parser("");
+		for (;;)
+		{
+			uint32_t header[2];
+			if (!readFully(fd, header, sizeof(header)) || header[0] == endOfInput)
+			{
+				_exit(0);
+			}
+			source.resize(header[1]);
+			if (!readFully(fd, &source[0], source.size()))
+			{
+				_exit(1);
+			}
+
+			EvalOutcome outcome;
+			try
+			{
+				VariableNode::clearVariables();
+				parser.reset(source);
+				if (unit == PROGRAM)
+				{
+					for (const auto &statement : parser.parseProgram())
+					{
+						outcome.value = parser.evaluate(statement);
+					}
+				}
+				else
+				{
+					outcome.value = parser.evaluate(parser.parse());
+				}
+				outcome.ok = true;
+			}
+			catch (const std::exception &e)
+			{
+				outcome.error = e.what();
+			}
+
+			reply.clear();
+			appendWord(reply, header[0]);
+			appendWord(reply, outcome.ok ? 1 : 0);
+			appendWord(reply, static_cast<uint32_t>(outcome.value));
+			appendWord(reply, static_cast<uint32_t>(outcome.error.size()));
+			reply += outcome.error;
+			if (!writeFully(fd, reply))
+			{
+				_exit(1);
+			}
+		}
+	}
+
+	void start(std::vector<Worker> &workers, size_t w, const std::vector<std::string> &inputs)
+	{
+		Worker &worker = workers[w];
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+		{
+			throw std::runtime_error("socketpair failed in shard coordinator");
+		}
+
+		std::cout.flush();
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			close(pair[0]);
+			close(pair[1]);
+			throw std::runtime_error("fork failed in shard coordinator");
+		}
+		if (pid == 0)
+		{
+			close(pair[0]);
+			for (Worker &other : workers)
+			{
+				if (other.fd >= 0)
+				{
+					close(other.fd);
+				}
+			}
+			workerMain(pair[1], unit);
+		}
+
+		close(pair[1]);
+		worker.pid = pid;
+		worker.fd = pair[0];
+		worker.inbox.clear();
+		worker.outbox.clear();
+		worker.sent = 0;
+		for (size_t i = worker.answered; i < worker.assigned.size(); i++)
+		{
+			const std::string &source = inputs[worker.assigned[i]];
+			appendWord(worker.outbox, static_cast<uint32_t>(worker.assigned[i]));
+			appendWord(worker.outbox, static_cast<uint32_t>(source.size()));
+			worker.outbox += source;
+		}
+		appendWord(worker.outbox, endOfInput);
+		appendWord(worker.outbox, 0);
+	}
+
+	// Returns false once the worker has closed its end.
+	bool receive(Worker &worker, std::vector<EvalOutcome> &outcomes)
+	{
+		char buffer[4096];
+		ssize_t n = recv(worker.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (n < 0)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		if (n == 0)
+		{
+			return false;
+		}
+		worker.inbox.append(buffer, static_cast<size_t>(n));
+
+		const size_t header = 4 * sizeof(uint32_t);
+		size_t offset = 0;
+		while (worker.inbox.size() - offset >= header)
+		{
+			uint32_t errorLength = readWord(worker.inbox, offset + 12);
+			if (worker.inbox.size() - offset < header + errorLength)
+			{
+				break;
+			}
+			uint32_t index = readWord(worker.inbox, offset);
+			EvalOutcome &outcome = outcomes[index];
+			outcome.ok = readWord(worker.inbox, offset + 4) != 0;
+			outcome.value = static_cast<int>(readWord(worker.inbox, offset + 8));
+			outcome.error.assign(worker.inbox, offset + header, errorLength);
+			worker.answered++;
+			offset += header + errorLength;
+		}
+		worker.inbox.erase(0, offset);
+		return true;
+	}
+
+	static void finish(Worker &worker)
+	{
+		close(worker.fd);
+		worker.fd = -1;
+		int status;
+		while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR)
+		{
+		}
+		worker.pid = -1;
+	}
+};
+#endif
+
+// Benchmark suite
+// A deterministic generator builds corpora of a given shape and size; each
+// corpus is then lexed (as a standalone pass), parsed and evaluated for a
+// number of iterations, timing every phase of every iteration separately.
+namespace bench
+{
+	// splitmix64: tiny, fast and identical on every platform.
+	class Random
+	{
+	private:
+		uint64_t state;
+
+	public:
+		Random(uint64_t seed) : state(seed) {}
+
+		uint64_t next()
+		{
+			uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			return z ^ (z >> 31);
+		}
+
+		int between(int low, int high)
+		{
+			return low + static_cast<int>(next() % static_cast<uint64_t>(high - low + 1));
+		}
+	};
+
+	struct Corpus
+	{
+		std::string name;
+		// One program for valid shapes; many short inputs for invalid ones.
+		std::vector<std::string> inputs;
+		size_t statements = 0;
+		bool valid = true;
+
+		size_t bytes() const
+		{
+			size_t total = 0;
+			for (const std::string &input : inputs)
+			{
+				total += input.size();
+			}
+			return total;
+		}
+	};
+
+	class Generator
+	{
+	private:
+		Random random;
+
+		// Operands stay small so no shape can overflow int.
+		std::string operand(int variables)
+		{
+			switch (random.between(0, variables > 0 ? 3 : 2))
+			{
+			case 0:
+				return std::to_string(random.between(0, 999));
+			case 1:
+				return "(" + std::to_string(random.between(1, 99)) + " * " + std::to_string(random.between(1, 99)) + ")";
+			case 2:
+				return "(" + std::to_string(random.between(100, 9999)) + " / " + std::to_string(random.between(1, 99)) + ")";
+			default:
+				return "v" + std::to_string(random.between(0, variables - 1));
+			}
+		}
+
+		const char *additive() { return random.between(0, 1) ? " + " : " - "; }
+
+		std::string declarations(Corpus &corpus, int variables)
+		{
+			std::string text;
+			for (int i = 0; i < variables; i++)
+			{
+				text += "v" + std::to_string(i) + " = " + std::to_string(random.between(0, 999)) + "\n";
+				corpus.statements++;
+			}
+			return text;
+		}
+
+		std::string ifStatement(int depth, const std::string &indent)
+		{
+			std::string inner = indent + "    ";
+			std::string text = indent + "if (" + operand(8) + additive() + operand(8) + ") then\n";
+			text += depth > 1 && random.between(0, 1) ? ifStatement(depth - 1, inner)
+													   : inner + "final = " + operand(8) + additive() + operand(8) + "\n";
+			if (random.between(0, 3) != 0)
+			{
+				text += indent + "else\n";
+				text += depth > 1 && random.between(0, 1) ? ifStatement(depth - 1, inner)
+														   : inner + "final = " + operand(8) + additive() + operand(8) + "\n";
+			}
+			return text + indent + "endif\n";
+		}
+
+	public:
+		Generator(uint64_t seed) : random(seed) {}
+
+		static std::vector<std::string> shapes()
+		{
+			return {"deep", "wide", "variables", "assignments", "nested-if", "invalid"};
+		}
+
+		Corpus generate(const std::string &shape, size_t bytes)
+		{
+			Corpus corpus;
+			corpus.name = shape;
+			std::string text;
+
+			if (shape == "deep")
+			{
+				// Each statement nests 64 levels of parentheses.
+				while (text.size() < bytes)
+				{
+					std::string e = operand(0);
+					for (int d = 0; d < 64; d++)
+					{
+						e = "(" + e + additive() + operand(0) + ")";
+					}
+					text += "d = " + e + "\n";
+					corpus.statements++;
+				}
+			}
+			else if (shape == "wide")
+			{
+				// 200 operands per statement, no nesting beyond one level.
+				text = declarations(corpus, 16);
+				while (text.size() < bytes)
+				{
+					std::string e = operand(16);
+					for (int t = 0; t < 199; t++)
+					{
+						e += additive() + operand(16);
+					}
+					text += "w = " + e + "\n";
+					corpus.statements++;
+				}
+			}
+			else if (shape == "variables")
+			{
+				// Hundreds of distinct names read and written at random.
+				const int variables = 512;
+				text = declarations(corpus, variables);
+				while (text.size() < bytes)
+				{
+					text += "v" + std::to_string(random.between(0, variables - 1)) + " = (v" +
+							std::to_string(random.between(0, variables - 1)) + additive() + "v" +
+							std::to_string(random.between(0, variables - 1)) + ") / 2\n";
+					corpus.statements++;
+				}
+			}
+			else if (shape == "assignments")
+			{
+				// Short statements, the overhead per statement dominates.
+				text = declarations(corpus, 8);
+				while (text.size() < bytes)
+				{
+					text += "v" + std::to_string(random.between(0, 7)) + " = " + operand(8) + "\n";
+					corpus.statements++;
+				}
+			}
+			else if (shape == "nested-if")
+			{
+				// Blocks shaped like sample.txt, nested up to four deep.
+				text = declarations(corpus, 8);
+				while (text.size() < bytes)
+				{
+					text += ifStatement(random.between(1, 4), "");
+					corpus.statements++;
+				}
+			}
+			else if (shape == "invalid")
+			{
+				// Valid-looking statements with one defect each.
+				corpus.valid = false;
+				size_t total = 0;
+				while (total < bytes)
+				{
+					std::string input = "x = " + operand(0) + additive() + operand(0);
+					switch (random.between(0, 3))
+					{
+					case 0:
+						input.insert(static_cast<size_t>(random.between(4, static_cast<int>(input.size()))), "$");
+						break;
+					case 1:
+						input = "x = (" + input.substr(4);
+						break;
+					case 2:
+						input += " +";
+						break;
+					default:
+						input = "if " + input.substr(4) + " then y = 1";
+						break;
+					}
+					total += input.size();
+					corpus.inputs.push_back(input);
+					corpus.statements++;
+				}
+				return corpus;
+			}
+			else
+			{
+				throw std::runtime_error("Unknown benchmark shape: " + shape);
+			}
+
+			corpus.inputs.push_back(text);
+			return corpus;
+		}
+	};
+
+	inline double percentile(std::vector<double> sorted, double p)
+	{
+		if (sorted.empty())
+		{
+			return 0.0;
+		}
+		std::sort(sorted.begin(), sorted.end());
+		size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+		return sorted[index];
+	}
+
+	struct PhaseSamples
+	{
+		std::vector<double> seconds;   // one per pass over the corpus
+		std::vector<double> latencies; // one per statement, over all passes
+		PerfCounters::Sample counters; // summed over all iterations
+
+		double percentile(double p) const { return bench::percentile(seconds, p); }
+		double latency(double p) const { return bench::percentile(latencies, p); }
+	};
+
+	struct Result
+	{
+		std::string shape;
+		size_t bytes = 0;
+		size_t statements = 0;
+		size_t rejected = 0;
+		PhaseSamples phases[stats::phaseCount]; // compile is direct compilation
+		PhaseSamples lowered;					// parse, then lower the trees
+		PhaseSamples vm;						// run the compiled code
+
+		// Every timed row with its name, phases first.
+		std::vector<std::pair<const char *, const PhaseSamples *>> rows() const
+		{
+			std::vector<std::pair<const char *, const PhaseSamples *>> all;
+			for (int p = 0; p < stats::phaseCount; p++)
+			{
+				all.emplace_back(stats::phaseName(static_cast<stats::Phase>(p)), &phases[p]);
+			}
+			all.emplace_back("ast+lower", &lowered);
+			all.emplace_back("vm", &vm);
+			return all;
+		}
+	};
+
+	inline double secondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Times one pass of a phase and, when perf is open, counts it in hardware.
+	class PhaseTimer
+	{
+	private:
+		const PerfCounters &perf;
+		std::chrono::steady_clock::time_point start;
+		PerfCounters::Sample counters;
+
+	public:
+		PhaseTimer(const PerfCounters &counters) : perf(counters), start(std::chrono::steady_clock::now()), counters(perf.read()) {}
+
+		double finish(PhaseSamples &samples)
+		{
+			perf.add(samples.counters, counters);
+			double seconds = secondsSince(start);
+			samples.seconds.push_back(seconds);
+			return seconds;
+		}
+	};
+
+	// Times every statement of a valid corpus, or every input of an invalid
+	// one, on its own in each phase, for latency percentiles. Lexing is cut
+	// at the token counts the parser consumed for each statement.
+	inline void sampleStatements(const Corpus &corpus, Result &result)
+	{
+		using Clock = std::chrono::steady_clock;
+		auto since = [](Clock::time_point start)
+		{ return std::chrono::duration<double>(Clock::now() - start).count(); };
+
+		for (const std::string &input : corpus.inputs)
+		{
+			std::vector<size_t> tokens;
+			std::vector<std::shared_ptr<ASTNode>> statements;
+			auto start = Clock::now();
+			try
+			{
+				// Construction reads the first token, so it is part of the
+				// first statement; a rejected statement is timed to the error.
+				Parser parser(input);
+				while (!parser.atEnd())
+				{
+					size_t before = parser.tokenCount();
+					start = Clock::now();
+					statements.push_back(parser.parse());
+					double seconds = since(start);
+					result.phases[stats::PARSE].latencies.push_back(seconds);
+
+					start = Clock::now();
+					Bytecode::lower({statements.back()});
+					result.lowered.latencies.push_back(seconds + since(start));
+					tokens.push_back(parser.tokenCount() - before);
+				}
+			}
+			catch (const ParseError &)
+			{
+				double seconds = since(start);
+				result.phases[stats::PARSE].latencies.push_back(seconds);
+				result.lowered.latencies.push_back(seconds);
+				tokens.push_back(SIZE_MAX);
+			}
+
+			try
+			{
+				Lexer lexer(input);
+				for (size_t count : tokens)
+				{
+					auto start = Clock::now();
+					for (size_t t = 0; t < count && lexer.nextToken().type != TokenType::END; t++)
+					{
+					}
+					result.phases[stats::LEX].latencies.push_back(since(start));
+				}
+			}
+			catch (const ParseError &)
+			{
+			}
+
+			std::vector<Bytecode> compiled;
+			start = Clock::now();
+			try
+			{
+				Compiler compiler(input);
+				while (!compiler.atEnd())
+				{
+					compiled.emplace_back();
+					start = Clock::now();
+					compiler.compile(compiled.back());
+					result.phases[stats::COMPILE].latencies.push_back(since(start));
+				}
+			}
+			catch (const ParseError &)
+			{
+				result.phases[stats::COMPILE].latencies.push_back(since(start));
+			}
+
+			if (corpus.valid)
+			{
+				for (auto &statement : statements)
+				{
+					auto start = Clock::now();
+					statement->evaluate();
+					result.phases[stats::EVALUATE].latencies.push_back(since(start));
+				}
+				VirtualMachine machine;
+				for (const Bytecode &code : compiled)
+				{
+					auto start = Clock::now();
+					machine.run(code);
+					result.vm.latencies.push_back(since(start));
+				}
+			}
+		}
+	}
+
+	inline Result run(const Corpus &corpus, int iterations, const PerfCounters &perf)
+	{
+		Result result;
+		result.shape = corpus.name;
+		result.bytes = corpus.bytes();
+		result.statements = corpus.statements;
+
+		for (int i = 0; i < iterations; i++)
+		{
+			size_t rejected = 0;
+
+			PhaseTimer lexing(perf);
+			for (const std::string &input : corpus.inputs)
+			{
+				try
+				{
+					Lexer lexer(input);
+					while (lexer.nextToken().type != TokenType::END)
+					{
+					}
+				}
+				catch (const ParseError &)
+				{
+				}
+			}
+			lexing.finish(result.phases[stats::LEX]);
+
+			std::vector<std::vector<std::shared_ptr<ASTNode>>> programs;
+			programs.reserve(corpus.inputs.size());
+			PhaseTimer parsing(perf);
+			for (const std::string &input : corpus.inputs)
+			{
+				try
+				{
+					Parser parser(input);
+					programs.push_back(parser.parseProgram());
+				}
+				catch (const ParseError &)
+				{
+					rejected++;
+				}
+			}
+			double parseSeconds = parsing.finish(result.phases[stats::PARSE]);
+
+			std::vector<Bytecode> compiled;
+			compiled.reserve(corpus.inputs.size());
+			PhaseTimer compiling(perf);
+			for (const std::string &input : corpus.inputs)
+			{
+				try
+				{
+					compiled.push_back(Compiler(input).compileProgram());
+				}
+				catch (const ParseError &)
+				{
+				}
+			}
+			compiling.finish(result.phases[stats::COMPILE]);
+
+			// Lowering is reported together with the parse it depends on.
+			PhaseTimer lowering(perf);
+			for (const auto &program : programs)
+			{
+				Bytecode::lower(program);
+			}
+			lowering.finish(result.lowered);
+			result.lowered.seconds.back() += parseSeconds;
+
+			if (corpus.valid)
+			{
+				PhaseTimer evaluating(perf);
+				for (auto &program : programs)
+				{
+					for (auto &statement : program)
+					{
+						statement->evaluate();
+					}
+				}
+				evaluating.finish(result.phases[stats::EVALUATE]);
+
+				VirtualMachine machine;
+				PhaseTimer running(perf);
+				for (const Bytecode &code : compiled)
+				{
+					machine.run(code);
+				}
+				running.finish(result.vm);
+			}
+			result.rejected = rejected;
+
+			// Separately, so the per-statement clock reads do not skew the
+			// pass totals above.
+			sampleStatements(corpus, result);
+		}
+		for (int e = 0; e < PerfCounters::eventCount; e++)
+		{
+			result.lowered.counters.values[e] += result.phases[stats::PARSE].counters.values[e];
+		}
+		return result;
+	}
+
+	struct Footprint
+	{
+		std::string item;
+		size_t size = 0;	// sizeof the object itself
+		uint64_t count = 0; // objects measured
+		uint64_t bytes = 0; // heap bytes requested for them
+
+		double perItem() const { return count ? static_cast<double>(bytes) / count : 0.0; }
+	};
+
+	struct MemoryResult
+	{
+		std::string shape;
+		size_t bytes = 0;
+		size_t statements = 0;
+		std::vector<Footprint> items;
+		int64_t heapPeak = 0;
+		long peakRss = -1; // KiB; -1 when unavailable
+		bool rssIsolated = false;
+	};
+
+	// Restarts the kernel's peak RSS counter so each shape gets its own.
+	inline bool resetPeakRss()
+	{
+#ifdef __linux__
+		std::ofstream clearRefs("/proc/self/clear_refs");
+		clearRefs << "5";
+		clearRefs.flush();
+		return static_cast<bool>(clearRefs);
+#else
+		return false;
+#endif
+	}
+
+	inline long peakRss()
+	{
+#ifdef __linux__
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status, line))
+		{
+			if (line.compare(0, 6, "VmHWM:") == 0)
+			{
+				return std::strtol(line.c_str() + 6, nullptr, 10);
+			}
+		}
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) == 0)
+		{
+			return usage.ru_maxrss;
+		}
+#endif
+		return -1;
+	}
+
+	// Heap bytes per token, per node type (make_shared blocks, so the
+	// control block is included) and per variable binding, plus the heap
+	// and RSS high-water marks while the corpus is lexed, parsed and run.
+	inline MemoryResult measureMemory(const Corpus &corpus)
+	{
+		alloc::enable();
+		alloc::State &s = alloc::state();
+		MemoryResult result;
+		result.shape = corpus.name;
+		result.bytes = corpus.bytes();
+		result.statements = corpus.statements;
+		result.rssIsolated = resetPeakRss();
+		s.total.resetPeak();
+		int64_t baseline = s.total.live.load();
+
+		Footprint tokens{"Token", sizeof(Token)};
+		std::vector<Token> lexed;
+		std::vector<std::string> names;
+		{
+			int64_t before = s.total.live.load();
+			for (const std::string &input : corpus.inputs)
+			{
+				try
+				{
+					Lexer lexer(input);
+					for (Token token = lexer.nextToken(); token.type != TokenType::END; token = lexer.nextToken())
+					{
+						lexed.push_back(token);
+					}
+				}
+				catch (const ParseError &)
+				{
+				}
+			}
+			lexed.shrink_to_fit();
+			tokens.count = lexed.size();
+			tokens.bytes = static_cast<uint64_t>(s.total.live.load() - before);
+		}
+		// Tokens hold no text, so names come from a second pass.
+		for (const std::string &input : corpus.inputs)
+		{
+			try
+			{
+				Lexer lexer(input);
+				for (Token token = lexer.nextToken(); token.type != TokenType::END; token = lexer.nextToken())
+				{
+					if (token.type == TokenType::IDENTIFIER)
+					{
+						names.emplace_back(lexer.text(token));
+					}
+				}
+			}
+			catch (const ParseError &)
+			{
+			}
+		}
+		std::sort(names.begin(), names.end());
+		names.erase(std::unique(names.begin(), names.end()), names.end());
+		std::vector<Token>().swap(lexed);
+		result.items.push_back(tokens);
+
+		struct NodeType
+		{
+			const std::type_info &type;
+			size_t size;
+		};
+		const NodeType nodeTypes[] = {
+			{typeid(NumberNode), sizeof(NumberNode)},
+			{typeid(VariableNode), sizeof(VariableNode)},
+			{typeid(BinaryOpNode), sizeof(BinaryOpNode)},
+			{typeid(AssignmentNode), sizeof(AssignmentNode)},
+			{typeid(IfNode), sizeof(IfNode)},
+		};
+		uint64_t allocations[sizeof(nodeTypes) / sizeof(nodeTypes[0])];
+		uint64_t bytes[sizeof(nodeTypes) / sizeof(nodeTypes[0])];
+		for (size_t t = 0; t < sizeof(nodeTypes) / sizeof(nodeTypes[0]); t++)
+		{
+			uint8_t index = alloc::nodeIndex(nodeTypes[t].type.name());
+			allocations[t] = s.nodes[index].allocations.load();
+			bytes[t] = s.nodes[index].bytes.load();
+		}
+
+		std::vector<std::vector<std::shared_ptr<ASTNode>>> programs;
+		for (const std::string &input : corpus.inputs)
+		{
+			try
+			{
+				Parser parser(input);
+				programs.push_back(parser.parseProgram());
+			}
+			catch (const ParseError &)
+			{
+			}
+		}
+		for (size_t t = 0; t < sizeof(nodeTypes) / sizeof(nodeTypes[0]); t++)
+		{
+			uint8_t index = alloc::nodeIndex(nodeTypes[t].type.name());
+			Footprint node{alloc::demangle(nodeTypes[t].type.name()), nodeTypes[t].size};
+			node.count = s.nodes[index].allocations.load() - allocations[t];
+			node.bytes = s.nodes[index].bytes.load() - bytes[t];
+			if (node.count > 0)
+			{
+				result.items.push_back(node);
+			}
+		}
+
+		if (corpus.valid)
+		{
+			for (auto &program : programs)
+			{
+				for (auto &statement : program)
+				{
+					statement->evaluate();
+				}
+			}
+		}
+
+		Footprint recognizer{"Recognizer", sizeof(Recognizer), corpus.inputs.size()};
+		{
+			Recognizer checker(true);
+			uint64_t before = s.total.bytes.load();
+			for (const std::string &input : corpus.inputs)
+			{
+				checker.recognize(input);
+			}
+			recognizer.bytes = s.total.bytes.load() - before;
+		}
+		result.items.push_back(recognizer);
+
+		if (corpus.valid)
+		{
+			Footprint onePass{"OnePassEvaluator", sizeof(OnePassEvaluator), corpus.inputs.size()};
+			uint64_t before = s.total.bytes.load();
+			for (const std::string &input : corpus.inputs)
+			{
+				OnePassEvaluator(input).evaluateProgram();
+			}
+			onePass.bytes = s.total.bytes.load() - before;
+			result.items.push_back(onePass);
+
+			// Reused compiler, program and machine; once warm they must not allocate.
+			Footprint warm{"warm compile+run", sizeof(Compiler) + sizeof(Bytecode) + sizeof(VirtualMachine),
+						   corpus.statements};
+			Compiler compiler("");
+			Bytecode code;
+			VirtualMachine machine;
+			for (int round = 0; round < 2; round++)
+			{
+				before = s.total.bytes.load();
+				for (const std::string &input : corpus.inputs)
+				{
+					compiler.reset(input);
+					code.clear();
+					while (!compiler.atEnd())
+					{
+						compiler.compile(code);
+					}
+					machine.run(code);
+				}
+			}
+			warm.bytes = s.total.bytes.load() - before;
+			result.items.push_back(warm);
+
+			// One Bytecode per statement, as a caller holding compiled
+			// expressions would keep them; small ones stay inline.
+			Footprint handles{"Bytecode", sizeof(Bytecode)};
+			before = s.total.bytes.load();
+			for (const std::string &input : corpus.inputs)
+			{
+				compiler.reset(input);
+				while (!compiler.atEnd())
+				{
+					Bytecode statement;
+					compiler.compile(statement);
+					handles.count++;
+				}
+			}
+			handles.bytes = s.total.bytes.load() - before;
+			result.items.push_back(handles);
+		}
+
+		// A private store shows the cost of each binding: its slot plus the
+		// heap copy of its name (and any tables chained on for overflow).
+		if (!names.empty() && names.size() <= VariableStore::initialCapacity)
+		{
+			std::unique_ptr<VariableStore> store(new VariableStore);
+			int64_t before = s.total.live.load();
+			for (const std::string &name : names)
+			{
+				store->resolve(name)->store(0);
+			}
+			Footprint binding{"binding", sizeof(VariableStore::Slot), names.size()};
+			binding.bytes = static_cast<uint64_t>(s.total.live.load() - before) +
+							names.size() * sizeof(VariableStore::Slot);
+			result.items.push_back(binding);
+		}
+
+		result.heapPeak = s.total.peak.load() - baseline;
+		result.peakRss = peakRss();
+		return result;
+	}
+
+	inline std::string jsonEscape(const std::string &text)
+	{
+		std::string escaped;
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+			{
+				escaped += '\\';
+				escaped += c;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20)
+			{
+				escaped += ' ';
+			}
+			else
+			{
+				escaped += c;
+			}
+		}
+		return escaped;
+	}
+
+	inline std::string cpuModel()
+	{
+		std::ifstream cpuinfo("/proc/cpuinfo");
+		std::string line;
+		while (std::getline(cpuinfo, line))
+		{
+			if (line.compare(0, 10, "model name") == 0)
+			{
+				size_t colon = line.find(':');
+				return colon == std::string::npos ? line : line.substr(colon + 2);
+			}
+		}
+		return "unknown";
+	}
+
+	struct Settings
+	{
+		uint64_t seed = 42;
+		size_t size = 65536;
+		int iterations = 30;
+	};
+
+	// Results with the environment they were measured in. Raw per-iteration
+	// samples are kept so comparisons can compute their own statistics.
+	inline void writeJson(std::ostream &out, const Settings &settings, const std::vector<Result> &results,
+						  const std::vector<MemoryResult> &memory = {})
+	{
+		std::time_t now = std::time(nullptr);
+		char timestamp[32];
+		std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+		out << std::setprecision(9);
+		out << "{\n  \"metadata\": {\n";
+		out << "    \"timestamp\": \"" << timestamp << "\",\n";
+#ifdef __VERSION__
+		out << "    \"compiler\": \"" << jsonEscape(__VERSION__) << "\",\n";
+#endif
+		out << "    \"cplusplus\": " << __cplusplus << ",\n";
+#ifdef NDEBUG
+		out << "    \"assertions\": false,\n";
+#else
+		out << "    \"assertions\": true,\n";
+#endif
+#ifdef __OPTIMIZE__
+		out << "    \"optimized\": true,\n";
+#else
+		out << "    \"optimized\": false,\n";
+#endif
+		out << "    \"cpu\": \"" << jsonEscape(cpuModel()) << "\",\n";
+		out << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+		out << "    \"seed\": " << settings.seed << ",\n";
+		out << "    \"size\": " << settings.size << ",\n";
+		out << "    \"iterations\": " << settings.iterations << "\n";
+		out << "  },\n  \"results\": [";
+
+		for (size_t r = 0; r < results.size(); r++)
+		{
+			const Result &result = results[r];
+			out << (r ? ",\n" : "\n") << "    {\"shape\": \"" << jsonEscape(result.shape) << "\", \"bytes\": " << result.bytes
+				<< ", \"statements\": " << result.statements << ", \"rejected\": " << result.rejected
+				<< ", \"seconds\": {";
+			bool firstPhase = true;
+			for (const auto &row : result.rows())
+			{
+				const std::vector<double> &seconds = row.second->seconds;
+				if (seconds.empty())
+				{
+					continue;
+				}
+				out << (firstPhase ? "" : ", ") << "\"" << row.first << "\": [";
+				firstPhase = false;
+				for (size_t i = 0; i < seconds.size(); i++)
+				{
+					out << (i ? ", " : "") << seconds[i];
+				}
+				out << "]";
+			}
+			out << "}, \"latency_us\": {";
+			firstPhase = true;
+			for (const auto &row : result.rows())
+			{
+				const PhaseSamples &samples = *row.second;
+				if (samples.latencies.empty())
+				{
+					continue;
+				}
+				out << (firstPhase ? "" : ", ") << "\"" << row.first << "\": {\"p50\": " << samples.latency(0.5) * 1e6
+					<< ", \"p90\": " << samples.latency(0.9) * 1e6 << ", \"p99\": " << samples.latency(0.99) * 1e6 << "}";
+				firstPhase = false;
+			}
+			out << "}}";
+		}
+		out << "\n  ]";
+
+		if (!memory.empty())
+		{
+			out << ",\n  \"memory\": [";
+			for (size_t r = 0; r < memory.size(); r++)
+			{
+				const MemoryResult &result = memory[r];
+				out << (r ? ",\n" : "\n") << "    {\"shape\": \"" << jsonEscape(result.shape) << "\", \"bytes\": " << result.bytes
+					<< ", \"statements\": " << result.statements << ", \"heap_peak\": " << result.heapPeak
+					<< ", \"peak_rss_kib\": " << result.peakRss << ", \"items\": {";
+				for (size_t i = 0; i < result.items.size(); i++)
+				{
+					const Footprint &item = result.items[i];
+					out << (i ? ", " : "") << "\"" << jsonEscape(item.item) << "\": {\"sizeof\": " << item.size
+						<< ", \"count\": " << item.count << ", \"bytes\": " << item.bytes << "}";
+				}
+				out << "}}";
+			}
+			out << "\n  ]";
+		}
+		out << "\n}\n";
+	}
+
+	// Just enough JSON to read back what writeJson produces.
+	struct Json
+	{
+		enum Kind
+		{
+			NUL,
+			BOOLEAN,
+			NUMBER,
+			STRING,
+			ARRAY,
+			OBJECT
+		};
+
+		Kind kind = NUL;
+		double number = 0;
+		std::string string;
+		std::vector<Json> items;
+		std::vector<std::pair<std::string, Json>> members;
+
+		const Json *find(const std::string &key) const
+		{
+			for (const auto &member : members)
+			{
+				if (member.first == key)
+				{
+					return &member.second;
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	class JsonReader
+	{
+	private:
+		const std::string &text;
+		size_t position = 0;
+
+		void skipWhitespace()
+		{
+			while (position < text.size() && isspace(static_cast<unsigned char>(text[position])))
+			{
+				position++;
+			}
+		}
+
+		char peek()
+		{
+			skipWhitespace();
+			return position < text.size() ? text[position] : '\0';
+		}
+
+		void expect(char c)
+		{
+			if (peek() != c)
+			{
+				throw std::runtime_error("Malformed benchmark JSON at offset " + std::to_string(position));
+			}
+			position++;
+		}
+
+		std::string string()
+		{
+			expect('"');
+			std::string result;
+			while (position < text.size() && text[position] != '"')
+			{
+				if (text[position] == '\\' && position + 1 < text.size())
+				{
+					position++;
+				}
+				result += text[position++];
+			}
+			expect('"');
+			return result;
+		}
+
+	public:
+		JsonReader(const std::string &input) : text(input) {}
+
+		Json value()
+		{
+			Json json;
+			char c = peek();
+			if (c == '{')
+			{
+				json.kind = Json::OBJECT;
+				position++;
+				if (peek() != '}')
+				{
+					do
+					{
+						std::string key = string();
+						expect(':');
+						json.members.emplace_back(key, value());
+					} while (peek() == ',' && ++position);
+				}
+				expect('}');
+			}
+			else if (c == '[')
+			{
+				json.kind = Json::ARRAY;
+				position++;
+				if (peek() != ']')
+				{
+					do
+					{
+						json.items.push_back(value());
+					} while (peek() == ',' && ++position);
+				}
+				expect(']');
+			}
+			else if (c == '"')
+			{
+				json.kind = Json::STRING;
+				json.string = string();
+			}
+			else if (text.compare(position, 4, "true") == 0 || text.compare(position, 5, "false") == 0)
+			{
+				json.kind = Json::BOOLEAN;
+				json.number = text[position] == 't' ? 1 : 0;
+				position += text[position] == 't' ? 4 : 5;
+			}
+			else if (text.compare(position, 4, "null") == 0)
+			{
+				position += 4;
+			}
+			else
+			{
+				json.kind = Json::NUMBER;
+				const char *start = text.c_str() + position;
+				char *end = nullptr;
+				json.number = std::strtod(start, &end);
+				if (end == start)
+				{
+					throw std::runtime_error("Malformed benchmark JSON at offset " + std::to_string(position));
+				}
+				position += static_cast<size_t>(end - start);
+			}
+			return json;
+		}
+	};
+
+	inline Json readJson(const std::string &path)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			throw std::runtime_error("Cannot read " + path);
+		}
+		std::stringstream contents;
+		contents << file.rdbuf();
+		std::string text = contents.str();
+		return JsonReader(text).value();
+	}
+
+	// Two-sided 95% Student t critical value. Tabulated up to 30 degrees of
+	// freedom, interpolated for Welch's fractional df; past that the
+	// Cornish-Fisher expansion is accurate to the third decimal.
+	inline double tCritical(double degreesOfFreedom)
+	{
+		static const double table[] = {
+			12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+			2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+			2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+		const double tabulated = sizeof(table) / sizeof(table[0]);
+
+		double df = std::max(degreesOfFreedom, 1.0);
+		if (df <= tabulated)
+		{
+			size_t below = static_cast<size_t>(df);
+			double fraction = df - below;
+			if (below == tabulated)
+			{
+				return table[below - 1];
+			}
+			return table[below - 1] + fraction * (table[below] - table[below - 1]);
+		}
+		const double z = 1.959964;
+		return z + (z * z * z + z) / (4 * df) +
+			   (5 * std::pow(z, 5) + 16 * z * z * z + 3 * z) / (96 * df * df);
+	}
+
+	struct Comparison
+	{
+		double oldMean = 0;
+		double newMean = 0;
+		double change = 0; // relative, (new - old) / old
+		double low = 0;	   // 95% confidence interval of change
+		double high = 0;
+		bool comparable = false; // false when the old mean is zero
+	};
+
+	// Welch's t interval for the difference in mean time, relative to the old mean.
+	inline Comparison compare(const std::vector<double> &before, const std::vector<double> &after)
+	{
+		auto meanVariance = [](const std::vector<double> &samples, double &mean, double &variance)
+		{
+			mean = 0;
+			for (double x : samples)
+			{
+				mean += x;
+			}
+			mean /= samples.size();
+			variance = 0;
+			for (double x : samples)
+			{
+				variance += (x - mean) * (x - mean);
+			}
+			variance = samples.size() > 1 ? variance / (samples.size() - 1) : 0;
+		};
+
+		Comparison c;
+		double oldVariance, newVariance;
+		meanVariance(before, c.oldMean, oldVariance);
+		meanVariance(after, c.newMean, newVariance);
+
+		double a = oldVariance / before.size();
+		double b = newVariance / after.size();
+		double error = std::sqrt(a + b);
+		double df = (a + b) * (a + b) /
+					((before.size() > 1 ? a * a / (before.size() - 1) : 0) +
+					 (after.size() > 1 ? b * b / (after.size() - 1) : 0) + 1e-300);
+		double margin = tCritical(df) * error;
+		double difference = c.newMean - c.oldMean;
+		if (c.oldMean <= 0)
+		{
+			return c;
+		}
+
+		c.comparable = true;
+		c.change = difference / c.oldMean;
+		c.low = (difference - margin) / c.oldMean;
+		c.high = (difference + margin) / c.oldMean;
+		return c;
+	}
+
+	// Memory figures are deterministic for a given corpus, so any growth past
+	// the threshold counts; peak RSS is only reported.
+	inline int compareMemory(std::ostream &out, const Json &before, const Json &after, double threshold)
+	{
+		const Json *oldMemory = before.find("memory");
+		const Json *newMemory = after.find("memory");
+		if (!oldMemory || !newMemory)
+		{
+			return 0;
+		}
+
+		int regressions = 0;
+		out << "shape        item               old(B)      new(B)   change   verdict\n";
+		out << std::fixed;
+		auto row = [&](const std::string &shape, const std::string &item, double oldBytes, double newBytes, bool gated)
+		{
+			if (oldBytes <= 0)
+			{
+				// Nothing to scale by: growth from zero is still growth.
+				bool grew = newBytes > 0;
+				out << std::left << std::setw(13) << shape << std::setw(15) << item << std::right << std::setprecision(1)
+					<< std::setw(12) << oldBytes << std::setw(12) << newBytes << std::setw(9) << "n/a" << "   "
+					<< (grew ? (gated ? "REGRESSION" : "larger") : "no change") << "\n";
+				regressions += grew && gated;
+				return;
+			}
+			double change = (newBytes - oldBytes) / oldBytes;
+			const char *verdict = "no change";
+			if (change > threshold)
+			{
+				verdict = gated ? "REGRESSION" : "larger";
+				regressions += gated;
+			}
+			else if (change < -threshold)
+			{
+				verdict = "smaller";
+			}
+			out << std::left << std::setw(13) << shape << std::setw(15) << item << std::right << std::setprecision(1)
+				<< std::setw(12) << oldBytes << std::setw(12) << newBytes << std::setw(8) << std::showpos
+				<< change * 100 << "%" << std::noshowpos << "   " << verdict << "\n";
+		};
+
+		for (const Json &oldResult : oldMemory->items)
+		{
+			const Json *shape = oldResult.find("shape");
+			for (const Json &newResult : newMemory->items)
+			{
+				const Json *newShape = newResult.find("shape");
+				if (!shape || !newShape || newShape->string != shape->string)
+				{
+					continue;
+				}
+				const Json *oldItems = oldResult.find("items");
+				const Json *newItems = newResult.find("items");
+				for (const auto &item : oldItems ? oldItems->members : std::vector<std::pair<std::string, Json>>{})
+				{
+					const Json *newItem = newItems ? newItems->find(item.first) : nullptr;
+					if (!newItem || !item.second.find("count") || !newItem->find("count"))
+					{
+						continue;
+					}
+					auto perItem = [](const Json &entry)
+					{
+						double count = entry.find("count")->number;
+						return count > 0 ? entry.find("bytes")->number / count : 0.0;
+					};
+					row(shape->string, item.first, perItem(item.second), perItem(*newItem), true);
+				}
+				if (oldResult.find("heap_peak") && newResult.find("heap_peak"))
+				{
+					row(shape->string, "heap peak", oldResult.find("heap_peak")->number,
+						newResult.find("heap_peak")->number, true);
+				}
+				if (oldResult.find("peak_rss_kib") && newResult.find("peak_rss_kib"))
+				{
+					row(shape->string, "peak RSS", oldResult.find("peak_rss_kib")->number * 1024,
+						newResult.find("peak_rss_kib")->number * 1024, false);
+				}
+			}
+		}
+		out.unsetf(std::ios::floatfield);
+		return regressions;
+	}
+
+	// Prints every shape and phase present in both files; returns the number
+	// of regressions, i.e. slowdowns whose whole interval exceeds threshold.
+	inline int compareFiles(std::ostream &out, const std::string &oldPath, const std::string &newPath, double threshold)
+	{
+		Json before = readJson(oldPath);
+		Json after = readJson(newPath);
+		const Json *oldResults = before.find("results");
+		const Json *newResults = after.find("results");
+		if (!oldResults || !newResults)
+		{
+			throw std::runtime_error("Benchmark JSON has no results");
+		}
+
+		int regressions = compareMemory(out, before, after, threshold);
+		if (oldResults->items.empty() || newResults->items.empty())
+		{
+			return regressions;
+		}
+		out << "shape        phase       old(us)     new(us)   change        95% CI   verdict\n";
+		out << std::fixed;
+		for (const Json &oldResult : oldResults->items)
+		{
+			const Json *shape = oldResult.find("shape");
+			const Json *newResult = nullptr;
+			for (const Json &candidate : newResults->items)
+			{
+				const Json *candidateShape = candidate.find("shape");
+				if (shape && candidateShape && candidateShape->string == shape->string)
+				{
+					newResult = &candidate;
+				}
+			}
+			if (!shape || !newResult || !oldResult.find("seconds") || !newResult->find("seconds"))
+			{
+				continue;
+			}
+
+			for (const auto &phase : oldResult.find("seconds")->members)
+			{
+				const Json *newPhase = newResult->find("seconds")->find(phase.first);
+				if (!newPhase || phase.second.items.empty() || newPhase->items.empty())
+				{
+					continue;
+				}
+				std::vector<double> oldSamples, newSamples;
+				for (const Json &x : phase.second.items)
+				{
+					oldSamples.push_back(x.number);
+				}
+				for (const Json &x : newPhase->items)
+				{
+					newSamples.push_back(x.number);
+				}
+
+				Comparison c = compare(oldSamples, newSamples);
+				if (!c.comparable)
+				{
+					out << std::left << std::setw(13) << shape->string << std::setw(8) << phase.first << std::right
+						<< std::setprecision(1) << std::setw(12) << c.oldMean * 1e6 << std::setw(12) << c.newMean * 1e6
+						<< std::setw(9) << "n/a" << std::setw(16) << "n/a" << "   no baseline\n";
+					continue;
+				}
+				const char *verdict = "no change";
+				if (c.low > threshold)
+				{
+					verdict = "REGRESSION";
+					regressions++;
+				}
+				else if (c.high < -threshold)
+				{
+					verdict = "improvement";
+				}
+				out << std::left << std::setw(13) << shape->string << std::setw(8) << phase.first << std::right
+					<< std::setprecision(1) << std::setw(12) << c.oldMean * 1e6 << std::setw(12) << c.newMean * 1e6
+					<< std::setw(8) << std::showpos << c.change * 100 << "%"
+					<< "  [" << std::setw(6) << c.low * 100 << "," << std::setw(6) << c.high * 100 << "]"
+					<< std::noshowpos << "   " << verdict << "\n";
+			}
+		}
+		out.unsetf(std::ios::floatfield);
+		return regressions;
+	}
+
+#ifdef __linux__
+	struct StartupResult
+	{
+		std::string mode;
+		PhaseSamples firstOutput;
+		PhaseSamples firstResult;
+		PhaseSamples exit;
+	};
+
+	// Spawns this executable with args, feeds it input and times the first
+	// byte of output, the first result line and process exit.
+	inline StartupResult measureStartup(const std::string &mode, const std::vector<std::string> &args,
+										const std::string &input, int runs)
+	{
+		StartupResult result;
+		result.mode = mode;
+		std::vector<char *> argv{const_cast<char *>("parser")};
+		for (const std::string &arg : args)
+		{
+			argv.push_back(const_cast<char *>(arg.c_str()));
+		}
+		argv.push_back(nullptr);
+
+		for (int run = 0; run < runs; run++)
+		{
+			int in[2], out[2];
+			if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+			{
+				throw std::runtime_error(std::string("pipe: ") + std::strerror(errno));
+			}
+			posix_spawn_file_actions_t actions;
+			posix_spawn_file_actions_init(&actions);
+			posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+			posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+
+			auto start = std::chrono::steady_clock::now();
+			pid_t pid;
+			int error = posix_spawn(&pid, "/proc/self/exe", &actions, nullptr, argv.data(), environ);
+			posix_spawn_file_actions_destroy(&actions);
+			close(in[0]);
+			close(out[1]);
+			if (error != 0)
+			{
+				close(in[1]);
+				close(out[0]);
+				throw std::runtime_error(std::string("posix_spawn: ") + std::strerror(error));
+			}
+
+			std::string line = input + "\n";
+			if (write(in[1], line.data(), line.size()) < 0)
+			{
+				// The child exited early; its output says why.
+			}
+			close(in[1]);
+
+			std::string output;
+			bool answered = false;
+			char buffer[4096];
+			ssize_t n;
+			while ((n = read(out[0], buffer, sizeof(buffer))) != 0)
+			{
+				if (n < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					break;
+				}
+				if (output.empty())
+				{
+					result.firstOutput.seconds.push_back(secondsSince(start));
+				}
+				output.append(buffer, static_cast<size_t>(n));
+				if (!answered && (output.find("Result:") != std::string::npos || output.find("Error:") != std::string::npos))
+				{
+					result.firstResult.seconds.push_back(secondsSince(start));
+					answered = true;
+				}
+			}
+			close(out[0]);
+
+			int status = 0;
+			while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			{
+			}
+			result.exit.seconds.push_back(secondsSince(start));
+			if (!answered)
+			{
+				throw std::runtime_error(mode + " mode produced no result");
+			}
+		}
+		return result;
+	}
+
+	inline void print(std::ostream &out, const StartupResult &result)
+	{
+		out << "  " << std::left << std::setw(10) << result.mode << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(12) << result.firstOutput.percentile(0.5) * 1e6
+			<< std::setw(12) << result.firstResult.percentile(0.5) * 1e6
+			<< std::setw(12) << result.firstResult.percentile(0.9) * 1e6
+			<< std::setw(12) << result.exit.percentile(0.5) * 1e6 << "\n";
+		out.unsetf(std::ios::floatfield);
+	}
+
+	// Round trips of one client against a server thread on a private ring,
+	// each request carrying one binding, after an untimed warm-up.
+	inline PhaseSamples measureShm(bool busyPoll, int requests)
+	{
+		std::string name = "/parser-bench-" + std::to_string(getpid());
+		ShmServer server(name, busyPoll, 1);
+		std::thread serving([&server]
+							{ server.serve(); });
+		PhaseSamples samples;
+		try
+		{
+			ShmClient client(name, busyPoll);
+			std::vector<std::pair<std::string, int>> bindings{{"x", 0}};
+			for (int i = -std::min(requests, 1000); i < requests; i++)
+			{
+				bindings[0].second = i;
+				auto start = std::chrono::steady_clock::now();
+				client.evaluate("(x * 2 + 1)", bindings);
+				if (i >= 0)
+				{
+					samples.seconds.push_back(secondsSince(start));
+				}
+			}
+		}
+		catch (...)
+		{
+			server.stop();
+			serving.join();
+			throw;
+		}
+		server.stop();
+		serving.join();
+		return samples;
+	}
+
+	inline void print(std::ostream &out, const char *mode, const PhaseSamples &samples)
+	{
+		double total = 0;
+		for (double seconds : samples.seconds)
+		{
+			total += seconds;
+		}
+		out << "  " << std::left << std::setw(10) << mode << std::right << std::fixed << std::setprecision(2)
+			<< std::setw(12) << total / std::max<size_t>(samples.seconds.size(), 1) * 1e6
+			<< std::setw(12) << samples.percentile(0.5) * 1e6
+			<< std::setw(12) << samples.percentile(0.9) * 1e6
+			<< std::setw(12) << samples.percentile(0.99) * 1e6 << "\n";
+		out.unsetf(std::ios::floatfield);
+	}
+#endif
+
+	inline void print(std::ostream &out, const Result &result)
+	{
+		out << result.shape << ": " << result.bytes << " bytes, " << result.statements << " statements";
+		if (result.rejected > 0)
+		{
+			out << ", " << result.rejected << " rejected";
+		}
+		out << ", " << result.phases[stats::LEX].seconds.size() << " iterations\n";
+		// Throughput from the median pass, latency percentiles per statement.
+		out << "  phase          MB/s      stmts/s     p50(us)     p90(us)     p99(us)\n";
+		out << std::fixed;
+		for (const auto &row : result.rows())
+		{
+			const PhaseSamples &samples = *row.second;
+			if (samples.seconds.empty())
+			{
+				continue;
+			}
+			double median = samples.percentile(0.5);
+			out << "  " << std::left << std::setw(10) << row.first << std::right
+				<< std::setw(10) << std::setprecision(1) << (median > 0 ? result.bytes / median / 1e6 : 0.0)
+				<< std::setw(13) << std::setprecision(0) << (median > 0 ? result.statements / median : 0.0)
+				<< std::setprecision(3)
+				<< std::setw(12) << samples.latency(0.5) * 1e6
+				<< std::setw(12) << samples.latency(0.9) * 1e6
+				<< std::setw(12) << samples.latency(0.99) * 1e6 << "\n";
+		}
+		out.unsetf(std::ios::floatfield);
+	}
+
+	// Hardware counters per statement, averaged over all iterations.
+	inline void print(std::ostream &out, const Result &result, const PerfCounters &perf)
+	{
+		print(out, result);
+		if (!perf.available())
+		{
+			return;
+		}
+		out << "  phase     cycles/stmt  instr/stmt    IPC  br-miss/stmt  cache-miss/stmt\n";
+		out << std::fixed;
+		for (const auto &row : result.rows())
+		{
+			const PhaseSamples &samples = *row.second;
+			if (samples.seconds.empty())
+			{
+				continue;
+			}
+			const double *values = samples.counters.values;
+			double n = static_cast<double>(result.statements) * samples.seconds.size();
+			auto column = [&](PerfCounters::Event e, int width)
+			{
+				out << std::setw(width);
+				if (perf.has(e) && n > 0)
+				{
+					out << values[e] / n;
+				}
+				else
+				{
+					out << "n/a";
+				}
+			};
+			out << "  " << std::left << std::setw(10) << row.first << std::right << std::setprecision(1);
+			column(PerfCounters::CYCLES, 11);
+			column(PerfCounters::INSTRUCTIONS, 12);
+			out << std::setprecision(2) << std::setw(7)
+				<< (values[PerfCounters::CYCLES] > 0 ? values[PerfCounters::INSTRUCTIONS] / values[PerfCounters::CYCLES] : 0.0)
+				<< std::setprecision(3);
+			column(PerfCounters::BRANCH_MISSES, 14);
+			column(PerfCounters::CACHE_MISSES, 17);
+			out << "\n";
+		}
+		out.unsetf(std::ios::floatfield);
+	}
+
+	inline void print(std::ostream &out, const MemoryResult &result)
+	{
+		out << result.shape << ": " << result.bytes << " bytes, " << result.statements << " statements\n";
+		out << "  item             sizeof     count    bytes/item\n";
+		out << std::fixed << std::setprecision(1);
+		for (const Footprint &item : result.items)
+		{
+			out << "  " << std::left << std::setw(15) << item.item << std::right << std::setw(8) << item.size
+				<< std::setw(10) << item.count;
+#ifndef PARSER_ALLOC_TRACKING
+			out << "           n/a\n";
+#else
+			out << std::setw(14) << item.perItem() << "\n";
+#endif
+		}
+		out.unsetf(std::ios::floatfield);
+#ifndef PARSER_ALLOC_TRACKING
+		out << "  heap peak n/a, peak RSS ";
+#else
+		out << "  heap peak " << result.heapPeak / 1024 << " KiB, peak RSS ";
+#endif
+		if (result.peakRss < 0)
+		{
+			out << "unavailable\n";
+		}
+		else
+		{
+			out << result.peakRss << " KiB" << (result.rssIsolated ? "" : " (whole process)") << "\n";
+		}
+	}
+}
+
+// Built-in self-tests
+// Run with --self-test [NAME...]. There is no separate test target, so the
+// checks are part of the binary and build in every configuration; each case
+// throws Failure on the first check that does not hold.
+namespace selftest
+{
+	class Failure : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	inline void check(bool condition, const std::string &what)
+	{
+		if (!condition)
+		{
+			throw Failure(what);
+		}
+	}
+
+	// Outgrows the first table, concurrently, and keeps every slot in place.
+	inline void variableStore()
+	{
+		VariableStore store;
+		const int names = 20000;
+		std::vector<VariableStore::Slot *> first(names);
+		for (int i = 0; i < names; i++)
+		{
+			first[i] = store.resolve("v" + std::to_string(i));
+			first[i]->store(i);
+		}
+		check(store.capacity() > VariableStore::initialCapacity, "store did not grow");
+
+		std::vector<std::thread> threads;
+		std::atomic<int> moved{0};
+		for (int t = 0; t < 4; t++)
+		{
+			threads.emplace_back([&, t]()
+								 {
+									 for (int i = 0; i < names; i++)
+									 {
+										 int n = (i * 7 + t * 1000) % names;
+										 if (store.resolve("v" + std::to_string(n)) != first[n])
+										 {
+											 moved++;
+										 }
+										 store.resolve("t" + std::to_string(i));
+									 } });
+		}
+		for (std::thread &thread : threads)
+		{
+			thread.join();
+		}
+		check(moved == 0, "a resolved slot moved");
+
+		for (int i = 0; i < names; i++)
+		{
+			int value = -1;
+			check(store.find("v" + std::to_string(i)) == first[i] && first[i]->load(value) && value == i,
+				  "lost v" + std::to_string(i));
+			check(store.find("t" + std::to_string(i)) == store.resolve("t" + std::to_string(i)),
+				  "t" + std::to_string(i) + " registered twice");
+		}
+		check(store.find("missing") == nullptr, "found an unregistered name");
+	}
+
+	// A thread's read section in one domain survives it reading through
+	// another domain, and another thread coming and going.
+	inline void rcuNestedDomains()
+	{
+		struct Probe
+		{
+			std::atomic<bool> *freed;
+			~Probe() { freed->store(true); }
+		};
+
+		RcuDomain a;
+		RcuDomain b;
+		std::atomic<bool> freed{false};
+		{
+			RcuDomain::ReadGuard outer(a);
+			{
+				RcuDomain::ReadGuard inner(b);
+			}
+			std::thread([&a]
+						{ RcuDomain::ReadGuard other(a); })
+				.join();
+			a.retire(new Probe{&freed});
+			a.tryReclaim();
+			check(!freed, "object freed inside a read section");
+		}
+		a.tryReclaim();
+		check(freed, "object not freed after the read section");
+	}
+
+	// Readers never see a version older than one they already saw, and
+	// every replaced version is freed once they are done.
+	inline void scriptSlotReload()
+	{
+		const int versions = 2000;
+		RcuDomain domain;
+		ScriptSlot slot(domain);
+		slot.load("1");
+		std::atomic<bool> done{false};
+		std::atomic<int> wrong{0};
+		std::atomic<uint64_t> reads{0};
+		std::vector<std::thread> readers;
+		for (int t = 0; t < 4; t++)
+		{
+			readers.emplace_back([&]
+								 {
+									 VirtualMachine machine;
+									 int last = 0;
+									 while (!done)
+									 {
+										 int value = slot.evaluate(machine);
+										 if (value < last || value < 1 || value > versions)
+										 {
+											 wrong++;
+										 }
+										 last = value;
+										 reads++;
+									 } });
+		}
+		for (int v = 2; v <= versions; v++)
+		{
+			slot.load(std::to_string(v));
+		}
+		while (reads.load() < 1000)
+		{
+			std::this_thread::yield();
+		}
+		done = true;
+		for (std::thread &reader : readers)
+		{
+			reader.join();
+		}
+		check(wrong == 0, std::to_string(wrong.load()) + " reads went backwards");
+		VirtualMachine machine;
+		check(slot.evaluate(machine) == versions, "last version not current");
+		domain.synchronize();
+		check(domain.pending() == 0, "replaced versions not freed");
+	}
+
+	// Missing variables are fetched in one batch per round, and the values
+	// fetched stay with the evaluation that asked for them.
+	inline void asyncFetch()
+	{
+		VariableNode::clearVariables();
+		LocalKeyValueStore store;
+		store.put("fa", 1);
+		store.put("fb", 2);
+		store.put("fc", 3);
+		AsyncEvaluator evaluator(store);
+		evaluator.submit("(fa + fb)");
+		evaluator.submit("fx = fc * 2\n(fx + fa)");
+		evaluator.submit("(fmissing + 1)");
+		evaluator.submit("(1 +");
+		evaluator.submit("7");
+		std::vector<EvalOutcome> outcomes = evaluator.run();
+
+		check(outcomes.size() == 5, "wrong number of outcomes");
+		check(outcomes[0].ok && outcomes[0].value == 3, "fa + fb");
+		check(outcomes[1].ok && outcomes[1].value == 7, "fx + fa");
+		check(!outcomes[2].ok && outcomes[2].error == "Undefined variable: fmissing", "missing variable");
+		check(!outcomes[3].ok && outcomes[3].error == "Invalid factor", "syntax error");
+		check(outcomes[4].ok && outcomes[4].value == 7, "constant");
+		check(store.batchCount() == 2, "expected 2 fetch batches, got " + std::to_string(store.batchCount()));
+
+		int value;
+		for (const char *name : {"fa", "fb", "fc"})
+		{
+			VariableStore::Slot *slot = VariableNode::find(name);
+			check(slot != nullptr && !slot->load(value), std::string(name) + " leaked into the store");
+		}
+		VariableNode::clearVariables();
+	}
+
+	// Every batch path rejects a line with no statement as Parser::parse
+	// does, rather than running it as an empty program.
+	inline void emptyStatement()
+	{
+		std::string text = "1 + 2\n\n  \n4\n";
+		std::vector<uint32_t> offsets{0, 6, 7, 10, 12};
+		auto line = [&](size_t i) { return text.substr(offsets[i], offsets[i + 1] - offsets[i]); };
+
+		VirtualMachine machine;
+		CompiledBatch batch;
+		batch.compile(text, offsets);
+		std::vector<EvalOutcome> outcomes;
+		batch.runAll(machine, outcomes);
+
+		CompileCache cache;
+		LocalKeyValueStore store;
+		AsyncEvaluator evaluator(store);
+		for (size_t i = 0; i + 1 < offsets.size(); i++)
+		{
+			evaluator.submit(line(i));
+		}
+		std::vector<EvalOutcome> fetched = evaluator.run();
+
+		for (size_t i = 0; i + 1 < offsets.size(); i++)
+		{
+			bool empty = i == 1 || i == 2;
+			std::string which = "line " + std::to_string(i) + " ";
+			std::string cached;
+			try
+			{
+				cached = std::to_string(machine.run(*cache.compile(line(i))));
+			}
+			catch (const ParseError &e)
+			{
+				cached = e.what();
+			}
+			if (empty)
+			{
+				check(!outcomes[i].ok && outcomes[i].error == "Invalid factor", which + "compiled: " + outcomes[i].error);
+				check(cached == "Invalid factor", which + "cached: " + cached);
+				check(!fetched[i].ok && fetched[i].error == "Invalid factor", which + "fetched: " + fetched[i].error);
+			}
+			else
+			{
+				int want = i == 0 ? 3 : 4;
+				check(outcomes[i].ok && outcomes[i].value == want, which + "compiled: " + outcomes[i].error);
+				check(cached == std::to_string(want), which + "cached: " + cached);
+				check(fetched[i].ok && fetched[i].value == want, which + "fetched: " + fetched[i].error);
+			}
+		}
+	}
+
+	// The VM stops at the node that crosses a small limit rather than at the
+	// end of its batch, and the largest limit does not wrap to zero.
+	inline void evalBudget()
+	{
+		std::string source = "1";
+		for (int i = 0; i < 200; i++)
+		{
+			source += " + 1";
+		}
+		Bytecode program = Compiler(source).compileProgram();
+		VirtualMachine machine;
+
+		for (uint64_t limit : {0, 1, 10, 255, 256, 300})
+		{
+			EvalBudget budget(limit);
+			bool exceeded = false;
+			try
+			{
+				machine.run(program, budget);
+			}
+			catch (const BudgetExceeded &)
+			{
+				exceeded = true;
+			}
+			check(exceeded, "limit " + std::to_string(limit) + " not enforced");
+			check(budget.nodesUsed() == limit + 1,
+				  "limit " + std::to_string(limit) + " charged " + std::to_string(budget.nodesUsed()));
+		}
+
+		EvalBudget largest(UINT64_MAX);
+		check(machine.run(program, largest) == 201, "wrong result under the largest limit");
+		check(largest.nodesUsed() == program.size(), "largest limit charged " + std::to_string(largest.nodesUsed()));
+	}
+
+	// Small samples get the tabulated t value rather than the expansion, and
+	// a zero baseline is reported as not comparable instead of dividing by it.
+	inline void benchCompare()
+	{
+		auto near = [](double a, double b) { return std::fabs(a - b) < 0.0015; };
+		check(near(bench::tCritical(1), 12.706), "t(1) = " + std::to_string(bench::tCritical(1)));
+		check(near(bench::tCritical(2), 4.303), "t(2) = " + std::to_string(bench::tCritical(2)));
+		check(near(bench::tCritical(4), 2.776), "t(4) = " + std::to_string(bench::tCritical(4)));
+		check(near(bench::tCritical(30), 2.042), "t(30) = " + std::to_string(bench::tCritical(30)));
+		check(near(bench::tCritical(60), 2.000), "t(60) = " + std::to_string(bench::tCritical(60)));
+		double between = bench::tCritical(2.5);
+		check(between < 4.303 && between > 3.182, "t(2.5) = " + std::to_string(between));
+
+		bench::Comparison same = bench::compare({1.0, 1.1, 0.9}, {1.0, 1.1, 0.9});
+		check(same.comparable && same.change == 0 && same.low < 0 && same.high > 0, "identical samples differ");
+		bench::Comparison zero = bench::compare({0.0, 0.0}, {1.0, 2.0});
+		check(!zero.comparable && std::isfinite(zero.change) && std::isfinite(zero.low), "zero baseline compared");
+	}
+
+	// Interactive requests are answered while bulk work holds every general
+	// worker, and the bulk work still completes afterwards.
+	inline void schedulerReserve()
+	{
+		std::mutex mutex;
+		std::condition_variable released;
+		bool release = false;
+		std::atomic<int> bulkStarted{0};
+		std::atomic<int> bulkDone{0};
+		{
+			RequestScheduler scheduler(2);
+			for (int i = 0; i < 4; i++)
+			{
+				scheduler.submit(
+					[&](VirtualMachine &)
+					{
+						bulkStarted++;
+						std::unique_lock<std::mutex> lock(mutex);
+						released.wait(lock, [&]
+									  { return release; });
+						return 0;
+					},
+					Priority::BULK,
+					[&](int, std::exception_ptr)
+					{ bulkDone++; });
+			}
+			while (bulkStarted < 2)
+			{
+				std::this_thread::yield();
+			}
+
+			std::future<int> interactive = scheduler.submit("(2 * 3 + 1)", Priority::INTERACTIVE);
+			bool answered = interactive.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+			int startedMeanwhile = bulkStarted;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				release = true;
+			}
+			released.notify_all();
+			check(startedMeanwhile == 2, "bulk work ran on the interactive worker");
+			check(answered, "interactive request starved by bulk work");
+			check(interactive.get() == 7, "wrong interactive result");
+		}
+		check(bulkDone == 4, "bulk work lost at shutdown");
+	}
+
+#ifdef __linux__
+	// Clients that die holding a ticket or a slot do not stall the ring,
+	// bindings stay with their request, and a live region is never taken
+	// over while an abandoned one is.
+	inline void shmDeadClient()
+	{
+		std::string name = "/parser-selftest-" + std::to_string(getpid());
+
+		pid_t crashed = fork();
+		if (crashed == 0)
+		{
+			new ShmServer(name);
+			_exit(0);
+		}
+		waitpid(crashed, nullptr, 0);
+
+		// A client of a server that died without stopping gives up.
+		std::future<std::string> orphaned = std::async(std::launch::async, [&name]
+													   {
+														   try
+														   {
+															   ShmClient client(name);
+															   client.evaluate("(1 + 1)");
+															   return std::string("answered");
+														   }
+														   catch (const std::exception &e)
+														   {
+															   return std::string(e.what());
+														   } });
+		if (orphaned.wait_for(std::chrono::seconds(5)) != std::future_status::ready)
+		{
+			shm::Region *dead = shm::mapRegion(name, false);
+			dead->stopping.store(1);
+			for (shm::Slot &slot : dead->slots)
+			{
+				shm::futexWakeAll(slot.state);
+			}
+			orphaned.wait();
+			munmap(dead, sizeof(shm::Region));
+			throw Failure("client hung on a dead server");
+		}
+		check(orphaned.get() == "Shared-memory server stopped", "client of a dead server was answered");
+
+		ShmServer server(name, false, 2);
+		bool taken = false;
+		try
+		{
+			ShmServer second(name);
+		}
+		catch (const std::runtime_error &)
+		{
+			taken = true;
+		}
+		check(taken, "a second server took over a live region");
+
+		std::thread serving([&server]
+							{ server.serve(); });
+		ShmClient client(name);
+		shm::Region *region = shm::mapRegion(name, false);
+		auto stopAndJoin = [&]
+		{
+			server.stop();
+			serving.join();
+			munmap(region, sizeof(shm::Region));
+		};
+		// Takes a ticket and claims its slot as ShmClient does; the server
+		// may have set the waiter bit on the free slot.
+		auto claim = [&region]() -> shm::Slot &
+		{
+			shm::Slot &slot = region->slots[region->head.fetch_add(1) % shm::ringSize];
+			uint32_t current = slot.state.load();
+			while (shm::stateOf(current) == shm::FREE &&
+				   !slot.state.compare_exchange_weak(current, shm::held(shm::CLAIMED, getpid())))
+			{
+			}
+			if (current & shm::waiterBit)
+			{
+				shm::futexWakeAll(slot.state);
+			}
+			return slot;
+		};
+
+		bool ok = client.evaluate("(fa + 1)", {{"fa", 2}}) == 3 &&
+				  client.evaluate("fa = fa * 10\n(fa)", {{"fa", 4}}) == 40;
+
+		// Names no program has used stay with the request that sent them.
+		ok = client.evaluate("(shmnew + 1)", {{"shmnew", 6}}) == 7 &&
+			 client.evaluate("shmset = 3\n(shmset * 2)") == 6 && ok;
+		std::string undefined;
+		try
+		{
+			client.evaluate("(shmghost)");
+		}
+		catch (const std::runtime_error &e)
+		{
+			undefined = e.what();
+		}
+		ok = undefined == "Undefined variable: shmghost" && ok;
+		bool unregistered = true;
+		for (const char *name : {"shmnew", "shmset", "shmghost"})
+		{
+			unregistered = VariableNode::find(name) == nullptr && unregistered;
+		}
+
+		// A live client slow to fill in the slot it claimed keeps it.
+		{
+			shm::Slot &slot = claim();
+			bool claimed = shm::ownerOf(slot.state.load()) == getpid();
+			std::this_thread::sleep_for(2 * shm::claimTimeout);
+			bool kept = claimed && shm::stateOf(slot.state.load()) == shm::CLAIMED;
+			strcpy(slot.request.expression, "(5 + 1)");
+			slot.request.bindingCount = 0;
+			shm::setState(slot.state, shm::REQUEST);
+			bool answered = shm::waitUntil(*region, slot.state, shm::RESPONSE, false,
+										   std::chrono::steady_clock::now() + std::chrono::seconds(5)) ==
+							shm::Wait::READY;
+			ok = answered && slot.response.ok && slot.response.value == 6 && ok;
+			shm::release(slot.state);
+			if (!kept || !answered)
+			{
+				stopAndJoin();
+				throw Failure(!kept ? "a live client's claimed slot was freed" : "slow claimant never answered");
+			}
+		}
+
+		// One client dies after taking a ticket, another after claiming its slot.
+		bool claimedAndDied = false;
+		for (bool claimant : {false, true})
+		{
+			pid_t child = fork();
+			if (child == 0)
+			{
+				if (claimant)
+				{
+					_exit(shm::ownerOf(claim().state.load()) == getpid() ? 0 : 1);
+				}
+				region->head.fetch_add(1);
+				_exit(0);
+			}
+			int status = 0;
+			waitpid(child, &status, 0);
+			claimedAndDied = claimant && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		}
+
+		std::future<bool> laps = std::async(std::launch::async, [&client]
+											{
+												for (int i = 0; i < 3 * static_cast<int>(shm::ringSize); i++)
+												{
+													if (client.evaluate("(" + std::to_string(i) + " + 1)") != i + 1)
+													{
+														return false;
+													}
+												}
+												return true; });
+		if (laps.wait_for(std::chrono::seconds(10)) != std::future_status::ready)
+		{
+			stopAndJoin();
+			laps.wait();
+			throw Failure("ring stalled behind a dead client");
+		}
+		ok = laps.get() && ok;
+		uint64_t skipped = server.skippedSlots();
+		stopAndJoin();
+
+		check(ok, "wrong result");
+		check(unregistered, "a request's new names were registered in the store");
+		check(claimedAndDied, "the dying client could not claim its slot");
+		check(skipped == 2, std::to_string(skipped) + " slots skipped, expected 2");
+		int value;
+		VariableStore::Slot *slot = VariableNode::find("fa");
+		check(slot == nullptr || !slot->load(value), "bindings leaked into the store");
+	}
+
+	// When the ring comes round to a slot whose request is still being
+	// evaluated, that request is not dispatched again and the client holding
+	// the slot's next ticket is still served.
+	inline void shmRingLap()
+	{
+		std::string name = "/parser-selftest-lap-" + std::to_string(getpid());
+
+		// Slow under any build: every load scans the request's assignments.
+		const int variables = 4000, loads = 400000;
+		std::string source;
+		for (int i = 0; i < variables; i++)
+		{
+			source += "lap" + std::to_string(i) + " = 1\n";
+		}
+		std::string last = "lap" + std::to_string(variables - 1);
+		source += "(" + last;
+		for (int i = 1; i < loads; i++)
+		{
+			source += " + " + last;
+		}
+		source += ")";
+		RcuDomain domain;
+		ScriptSlot script(domain);
+		script.load(source);
+
+		ShmServer server(name, false, 1);
+		server.useScript(script);
+		std::thread serving([&server]
+							{ server.serve(); });
+		shm::Region *region = shm::mapRegion(name, false);
+		auto stopAndJoin = [&]
+		{
+			server.stop();
+			serving.join();
+			munmap(region, sizeof(shm::Region));
+		};
+
+		auto evaluate = [&name](std::string expression, Priority priority)
+		{
+			ShmClient client(name);
+			return client.evaluate(expression, {}, priority);
+		};
+		std::future<int> slow = std::async(std::launch::async, evaluate, std::string(), Priority::BULK);
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (shm::stateOf(region->slots[0].state.load()) != shm::DISPATCHED &&
+			   std::chrono::steady_clock::now() < deadline)
+		{
+			std::this_thread::yield();
+		}
+
+		const int clients = 2 * static_cast<int>(shm::ringSize);
+		std::vector<std::future<int>> quick;
+		for (int i = 0; i < clients; i++)
+		{
+			quick.push_back(std::async(std::launch::async, evaluate, "(" + std::to_string(i) + " + 1)",
+									   Priority::INTERACTIVE));
+		}
+		while (region->head.load() <= static_cast<uint64_t>(clients) && std::chrono::steady_clock::now() < deadline)
+		{
+			std::this_thread::yield();
+		}
+		bool lapped = slow.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+
+		bool finished = slow.wait_until(deadline) == std::future_status::ready;
+		for (std::future<int> &result : quick)
+		{
+			finished = finished && result.wait_until(deadline) == std::future_status::ready;
+		}
+		stopAndJoin();
+		check(finished, "a client was never served");
+
+		bool ok = true;
+		std::string wrong;
+		for (int i = 0; i < clients; i++)
+		{
+			try
+			{
+				int value = quick[static_cast<size_t>(i)].get();
+				if (value != i + 1)
+				{
+					ok = false;
+					wrong = "client " + std::to_string(i) + " got " + std::to_string(value);
+				}
+			}
+			catch (const std::exception &e)
+			{
+				ok = false;
+				wrong = "client " + std::to_string(i) + ": " + e.what();
+			}
+		}
+		check(lapped, "the slow request finished before the ring came round");
+		check(slow.get() == loads, "wrong result for the slow request");
+		check(ok, wrong);
+		check(server.skippedSlots() == 0, "a live client's slot was skipped");
+	}
+#endif
+
+#ifdef __linux__
+	// Programs sharded across worker processes give the results they give in
+	// one process, whatever the worker count, and an input that crashes its
+	// worker is retried on a fresh one and then reported alone.
+	inline void shardLocal()
+	{
+		std::vector<std::string> inputs;
+		std::vector<int> expected;
+		for (int i = 0; i < 40; i++)
+		{
+			std::string n = std::to_string(i);
+			inputs.push_back("sa = " + n + "\nsb = sa * 2\nif sa then sb = sb + 1 endif\n(sa + sb)");
+			expected.push_back(i + 2 * i + (i != 0 ? 1 : 0));
+		}
+		inputs.push_back(std::string(1000000, '(') + "1" + std::string(1000000, ')'));
+		inputs.push_back("(sa)");
+
+		for (size_t workers : {1, 3, 8})
+		{
+			ShardCoordinator coordinator(workers, 2, ShardCoordinator::PROGRAM);
+			std::vector<EvalOutcome> outcomes = coordinator.run(inputs);
+			std::string label = std::to_string(workers) + " workers: ";
+			check(outcomes.size() == inputs.size(), label + "wrong number of outcomes");
+			for (size_t i = 0; i < expected.size(); i++)
+			{
+				check(outcomes[i].ok && outcomes[i].value == expected[i], label + "input " + std::to_string(i));
+			}
+			check(!outcomes[40].ok && outcomes[40].error == "Worker crashed", label + "crash not reported");
+			check(coordinator.restarts() >= 1, label + "crashed worker not restarted");
+			check(!outcomes[41].ok && outcomes[41].error == "Undefined variable: sa", label + "variables leaked between inputs");
+		}
+	}
+#endif
+
+#ifdef __linux__
+	// A client that never sends its request neither blocks scrapes for
+	// longer than the request timeout nor holds up shutdown.
+	inline void metricsExporter()
+	{
+		auto connectTo = [](uint16_t port)
+		{
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			sockaddr_in address = {};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(port);
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			check(fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0,
+				  "cannot connect to the exporter");
+			return fd;
+		};
+		auto scrape = [&](uint16_t port)
+		{
+			int fd = connectTo(port);
+			const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+			send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+			std::string response;
+			char buffer[4096];
+			ssize_t n;
+			while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+			{
+				response.append(buffer, static_cast<size_t>(n));
+			}
+			close(fd);
+			return response;
+		};
+
+		check(metrics::classify(std::out_of_range("stoi")) == metrics::PARSE_ERROR,
+			  "out-of-range literal not counted as a parse error");
+
+		std::unique_ptr<metrics::HttpExporter> exporter(new metrics::HttpExporter(0));
+		uint16_t port = exporter->port();
+		int silent = connectTo(port);
+		std::string response = scrape(port);
+		check(response.compare(0, 15, "HTTP/1.0 200 OK") == 0, "scrape failed behind a silent client");
+		close(silent);
+
+		// Stop while the exporter waits on a silent client's request.
+		silent = connectTo(port);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		auto start = std::chrono::steady_clock::now();
+		exporter.reset();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		close(silent);
+		check(seconds < 0.5, "shutdown took " + std::to_string(seconds) + "s behind a silent client");
+	}
+#endif
+
+	// The trace can be written while other threads are still recording, and
+	// then holds every span they finished.
+	inline void traceConcurrent()
+	{
+		auto countSpans = [](const std::string &path)
+		{
+			std::ifstream in(path);
+			std::string line;
+			size_t spans = 0;
+			while (std::getline(in, line))
+			{
+				spans += line.find("\"name\":\"selftest\"") != std::string::npos;
+			}
+			return spans;
+		};
+
+		std::string path = "/tmp/parser-selftest-trace-" + std::to_string(getpid()) + ".json";
+		const int threads = 3;
+		const int spans = 3 * trace::ThreadBuffer::Chunk::capacity;
+		trace::enable();
+		std::atomic<int> running{threads};
+		std::vector<std::thread> recorders;
+		for (int t = 0; t < threads; t++)
+		{
+			recorders.emplace_back([&]
+								   {
+									   for (int i = 0; i < spans; i++)
+									   {
+										   trace::Span span("selftest");
+									   }
+									   running--; });
+		}
+		size_t seen = 0;
+		while (running > 0)
+		{
+			check(trace::write(path), "cannot write " + path);
+			size_t now = countSpans(path);
+			check(now >= seen, "a span disappeared");
+			seen = now;
+		}
+		for (std::thread &recorder : recorders)
+		{
+			recorder.join();
+		}
+		check(trace::write(path), "cannot write " + path);
+		size_t total = countSpans(path);
+		std::remove(path.c_str());
+		check(total == static_cast<size_t>(threads * spans), std::to_string(total) + " spans written");
+	}
+
+	// Over-aligned objects get their alignment back from operator new, and
+	// with tracking compiled in they are counted and released like others.
+	inline void alignedNew()
+	{
+		struct alignas(64) Line
+		{
+			char bytes[64];
+		};
+		struct alignas(4096) Page
+		{
+			char bytes[100];
+		};
+
+		alloc::enable();
+		int64_t before = alloc::state().total.live.load();
+		std::unique_ptr<Line> line(new Line());
+		std::unique_ptr<Page[]> pages(new Page[3]);
+		Page *quiet = new (std::nothrow) Page();
+		check(reinterpret_cast<uintptr_t>(line.get()) % 64 == 0, "64-byte object misaligned");
+		check(reinterpret_cast<uintptr_t>(pages.get()) % 4096 == 0, "page array misaligned");
+		check(quiet != nullptr && reinterpret_cast<uintptr_t>(quiet) % 4096 == 0, "nothrow page misaligned");
+#ifdef PARSER_ALLOC_TRACKING
+		int64_t counted = alloc::state().total.live.load() - before;
+		check(counted >= static_cast<int64_t>(sizeof(Line) + sizeof(Page) * 4), "aligned blocks not tracked");
+#endif
+		delete quiet;
+		line.reset();
+		pages.reset();
+		// Read before the failure message is built, as that allocates too.
+		bool released = alloc::state().total.live.load() == before;
+		check(released, "aligned blocks not released");
+	}
+
+	struct Case
+	{
+		const char *name;
+		void (*run)();
+	};
+
+	inline const std::vector<Case> &cases()
+	{
+		static const std::vector<Case> all = {
+			{"variable-store", variableStore},
+			{"rcu-nested-domains", rcuNestedDomains},
+			{"script-slot-reload", scriptSlotReload},
+			{"async-fetch", asyncFetch},
+			{"empty-statement", emptyStatement},
+			{"trace-concurrent", traceConcurrent},
+			{"aligned-new", alignedNew},
+			{"eval-budget", evalBudget},
+			{"bench-compare", benchCompare},
+			{"scheduler-reserve", schedulerReserve},
+#ifdef __linux__
+			{"shm-dead-client", shmDeadClient},
+			{"shm-ring-lap", shmRingLap},
+			{"shard-local", shardLocal},
+			{"metrics-exporter", metricsExporter},
+#endif
+		};
+		return all;
+	}
+
+	// Runs the named cases, or all of them; returns the number that failed.
+	inline int run(std::ostream &out, const std::vector<std::string> &names)
+	{
+		int failed = 0;
+		size_t ran = 0;
+		for (const Case &test : cases())
+		{
+			if (!names.empty() && std::find(names.begin(), names.end(), test.name) == names.end())
+			{
+				continue;
+			}
+			ran++;
+			try
+			{
+				test.run();
+				out << "ok    " << test.name << std::endl;
+			}
+			catch (const std::exception &e)
+			{
+				failed++;
+				out << "FAIL  " << test.name << ": " << e.what() << std::endl;
+			}
+		}
+		if (ran < names.size())
+		{
+			out << "FAIL  unknown test name" << std::endl;
+			failed++;
+		}
+		return failed;
+	}
+}
+
+#ifdef __linux__
+static ShmServer *activeShmServer = nullptr;
+
+static void stopShmServer(int)
+{
+	if (activeShmServer != nullptr)
+	{
+		activeShmServer->stop();
+	}
+}
+
+// --shm-server NAME [--busy-poll] [--workers N] [--metrics-port N] [--metrics-file PATH] [--script FILE]
+// --shm-client NAME [--busy-poll] [--bulk] [--bind name=value]...
+// With --script, an empty request line runs the script, which is reloaded
+// whenever FILE changes.
+static int runShm(const std::vector<std::string> &args)
+{
+	if (args.size() < 2)
+	{
+		std::cout << "Error: " << args[0] << " needs a region name" << std::endl;
+		return 1;
+	}
+
+	bool busyPoll = false;
+	std::vector<std::pair<std::string, int>> bindings;
+	Priority priority = Priority::INTERACTIVE;
+	size_t workers = std::max(1u, std::thread::hardware_concurrency());
+	int metricsPort = 0;
+	std::string metricsFile;
+	std::string scriptFile;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args[i] == "--busy-poll")
+		{
+			busyPoll = true;
+		}
+		else if (args[i] == "--metrics-port" && i + 1 < args.size())
+		{
+			metricsPort = std::stoi(args[++i]);
+		}
+		else if (args[i] == "--metrics-file" && i + 1 < args.size())
+		{
+			metricsFile = args[++i];
+		}
+		else if (args[i] == "--script" && i + 1 < args.size())
+		{
+			scriptFile = args[++i];
+		}
+		else if (args[i] == "--workers" && i + 1 < args.size())
+		{
+			workers = std::stoul(args[++i]);
+		}
+		else if (args[i] == "--bulk")
+		{
+			priority = Priority::BULK;
+		}
+		else if (args[i] == "--bind" && i + 1 < args.size())
+		{
+			const std::string &binding = args[++i];
+			size_t eq = binding.find('=');
+			if (eq == std::string::npos)
+			{
+				std::cout << "Error: binding must be name=value: " << binding << std::endl;
+				return 1;
+			}
+			bindings.push_back({binding.substr(0, eq), std::stoi(binding.substr(eq + 1))});
+		}
+	}
+
+	try
+	{
+		if (args[0] == "--shm-server")
+		{
+			RcuDomain domain;
+			ScriptSlot script(domain);
+			ShmServer server(args[1], busyPoll, workers);
+			std::unique_ptr<ScriptReloader> reloader;
+			if (!scriptFile.empty())
+			{
+				reloader.reset(new ScriptReloader(script, scriptFile));
+				server.useScript(script);
+			}
+			std::unique_ptr<metrics::HttpExporter> httpExporter;
+			std::unique_ptr<metrics::FileExporter> fileExporter;
+			if (metricsPort > 0)
+			{
+				httpExporter.reset(new metrics::HttpExporter(static_cast<uint16_t>(metricsPort)));
+			}
+			if (!metricsFile.empty())
+			{
+				fileExporter.reset(new metrics::FileExporter(metricsFile, std::chrono::seconds(10)));
+			}
+			activeShmServer = &server;
+
+			// No SA_RESTART, so a sleeping futex wait returns on the signal.
+			struct sigaction action = {};
+			action.sa_handler = stopShmServer;
+			sigaction(SIGINT, &action, nullptr);
+			sigaction(SIGTERM, &action, nullptr);
+			server.serve();
+			activeShmServer = nullptr;
+			return 0;
+		}
+
+		ShmClient client(args[1], busyPoll);
+		std::string line;
+		while (std::getline(std::cin, line))
+		{
+			try
+			{
+				int result = client.evaluate(line, bindings, priority);
+				std::cout << "Result: " << result << std::endl;
+			}
+			catch (const std::exception &e)
+			{
+				std::cout << "Error: " << e.what() << std::endl;
+			}
 		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
 
-		eat(TokenType::ENDIF);
-		return std::make_shared<IfNode>(condition, thenBranch, elseBranch);
+// --shard N [FILE...]: evaluates each stdin line, or each FILE as a whole
+// program, independently across N processes
+static int runShards(const std::vector<std::string> &args)
+{
+	try
+	{
+		size_t workers = args.size() > 1 ? std::stoul(args[1]) : std::thread::hardware_concurrency();
+		std::vector<std::string> inputs;
+		for (size_t i = 2; i < args.size(); i++)
+		{
+			std::ifstream file(args[i]);
+			if (!file)
+			{
+				throw std::runtime_error("Cannot read " + args[i]);
+			}
+			std::stringstream contents;
+			contents << file.rdbuf();
+			inputs.push_back(contents.str());
+		}
+		bool programs = !inputs.empty();
+		std::string line;
+		while (!programs && std::getline(std::cin, line))
+		{
+			inputs.push_back(line);
+		}
+
+		ShardCoordinator coordinator(workers, 2, programs ? ShardCoordinator::PROGRAM : ShardCoordinator::STATEMENT);
+		for (const EvalOutcome &outcome : coordinator.run(inputs))
+		{
+			if (outcome.ok)
+			{
+				std::cout << "Result: " << outcome.value << "\n";
+			}
+			else
+			{
+				std::cout << "Error: " << outcome.error << "\n";
+			}
+		}
+		std::cout.flush();
 	}
+	catch (const std::exception &e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+#endif
 
-public:
-	Parser(const std::string &text) : lexer(text)
+static bool hasFlag(const std::vector<std::string> &args, const char *flag)
+{
+	return std::find(args.begin(), args.end(), flag) != args.end();
+}
+
+// Value following option in args, or empty if absent.
+static std::string optionValue(const std::vector<std::string> &args, const char *option)
+{
+	auto it = std::find(args.begin(), args.end(), option);
+	return (it != args.end() && it + 1 != args.end()) ? *(it + 1) : std::string();
+}
+
+// --bench [--shape NAME] [--size BYTES] [--iterations N] [--seed S] [--json FILE] [--perf]
+static int runBench(const std::vector<std::string> &args)
+{
+	try
+	{
+		std::string shape = optionValue(args, "--shape");
+		std::string size = optionValue(args, "--size");
+		std::string iterations = optionValue(args, "--iterations");
+		std::string seed = optionValue(args, "--seed");
+		std::string json = optionValue(args, "--json");
+
+		bench::Settings settings;
+		if (!seed.empty())
+			settings.seed = std::stoull(seed);
+		if (!size.empty())
+			settings.size = std::stoul(size);
+		if (!iterations.empty())
+			settings.iterations = std::stoi(iterations);
+
+		PerfCounters perf(hasFlag(args, "--perf"));
+		if (hasFlag(args, "--perf") && !perf.available())
+		{
+			std::cerr << "Hardware counters unavailable: " << perf.unavailableReason() << std::endl;
+		}
+
+		std::vector<std::string> shapes = shape.empty() ? bench::Generator::shapes() : std::vector<std::string>{shape};
+		bench::Generator generator(settings.seed);
+		std::vector<bench::Result> results;
+		for (const std::string &name : shapes)
+		{
+			bench::Corpus corpus = generator.generate(name, settings.size);
+			results.push_back(bench::run(corpus, settings.iterations, perf));
+			bench::print(std::cout, results.back(), perf);
+		}
+
+		if (!json.empty())
+		{
+			std::ofstream file(json, std::ios::trunc);
+			bench::writeJson(file, settings, results);
+			if (!file)
+			{
+				throw std::runtime_error("Cannot write " + json);
+			}
+		}
+	}
+	catch (const std::exception &e)
 	{
-		currentToken = lexer.nextToken();
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
 	}
+	return 0;
+}
 
-	std::shared_ptr<ASTNode> parse()
+// --bench-memory [--shape NAME] [--size BYTES] [--seed S] [--json FILE]
+static int runBenchMemory(const std::vector<std::string> &args)
+{
+	try
+	{
+		std::string shape = optionValue(args, "--shape");
+		std::string size = optionValue(args, "--size");
+		std::string seed = optionValue(args, "--seed");
+		std::string json = optionValue(args, "--json");
+
+		bench::Settings settings;
+		settings.iterations = 1;
+		if (!seed.empty())
+			settings.seed = std::stoull(seed);
+		if (!size.empty())
+			settings.size = std::stoul(size);
+
+		std::vector<std::string> shapes = shape.empty() ? bench::Generator::shapes() : std::vector<std::string>{shape};
+		bench::Generator generator(settings.seed);
+		std::vector<bench::MemoryResult> results;
+		for (const std::string &name : shapes)
+		{
+			results.push_back(bench::measureMemory(generator.generate(name, settings.size)));
+			bench::print(std::cout, results.back());
+		}
+
+		if (!json.empty())
+		{
+			std::ofstream file(json, std::ios::trunc);
+			bench::writeJson(file, settings, {}, results);
+			if (!file)
+			{
+				throw std::runtime_error("Cannot write " + json);
+			}
+		}
+	}
+	catch (const std::exception &e)
 	{
-		return statement();
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
 	}
+	return 0;
+}
 
-	int evaluate(std::shared_ptr<ASTNode> node)
+#ifdef __linux__
+// --bench-startup [--runs N] [--input TEXT]
+// Cold start of the default mode against --quick, one process per run.
+static int runBenchStartup(const std::vector<std::string> &args)
+{
+	try
 	{
-		return node->evaluate();
+		std::string runs = optionValue(args, "--runs");
+		std::string input = optionValue(args, "--input");
+		int count = runs.empty() ? 50 : std::stoi(runs);
+		if (input.empty())
+			input = "(12 + 30) * 2 - 7 / 7";
+
+		// One untimed spawn pulls the binary into the page cache.
+		bench::measureStartup("warm-up", {}, input, 1);
+
+		std::cout << "startup: " << count << " runs, input \"" << input << "\"\n";
+		std::cout << "  mode      output(us)  result(us)   p90(us)    exit(us)\n";
+		bench::print(std::cout, bench::measureStartup("default", {}, input, count));
+		bench::print(std::cout, bench::measureStartup("quick", {"--quick"}, input, count));
 	}
-};
+	catch (const std::exception &e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
 
-int main()
+// --bench-shm [--requests N]
+// Shared-memory round-trip latency, sleeping on futexes and busy-polling.
+static int runBenchShm(const std::vector<std::string> &args)
 {
 	try
 	{
-		std::string input;
-		std::cout << "Enter expression: ";
-		std::getline(std::cin, input);
+		std::string requests = optionValue(args, "--requests");
+		int count = requests.empty() ? 100000 : std::stoi(requests);
+
+		std::cout << "shm round trip: " << count << " requests\n";
+		std::cout << "  mode         mean(us)    p50(us)     p90(us)     p99(us)\n";
+		bench::print(std::cout, "futex", bench::measureShm(false, count));
+		if (std::thread::hardware_concurrency() >= 3)
+		{
+			bench::print(std::cout, "busy-poll", bench::measureShm(true, count));
+		}
+		else
+		{
+			std::cout << "  busy-poll  skipped: needs a CPU each for client, server and worker\n";
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+// --quick: the interactive mode through stdio alone, for one-shot use where
+// process start-up dominates. std::cin and std::cout are never touched and
+// no optional subsystem is initialized, so it takes no other options.
+static int runQuickStart()
+{
+	std::fputs("Enter expression: ", stdout);
+	std::string text;
+	char buffer[256];
+	while (std::fgets(buffer, sizeof(buffer), stdin) != nullptr)
+	{
+		text += buffer;
+		if (text.back() == '\n')
+		{
+			text.pop_back();
+			break;
+		}
+	}
 
-		Parser parser(input);
+	try
+	{
+		Parser parser(text);
 		auto ast = parser.parse();
-		int result = parser.evaluate(ast);
+		std::printf("Result: %d\n", parser.evaluate(ast));
+	}
+	catch (const std::exception &e)
+	{
+		std::printf("Error: %s\n", e.what());
+	}
+	return 0;
+}
 
-		std::cout << "Result: " << result << std::endl;
+// --bench-compare OLD.json NEW.json [--threshold PERCENT]
+// Exits with status 2 when any phase regressed significantly.
+static int runBenchCompare(const std::vector<std::string> &args)
+{
+	if (args.size() < 3)
+	{
+		std::cout << "Error: --bench-compare needs two result files" << std::endl;
+		return 1;
+	}
+	try
+	{
+		std::string threshold = optionValue(args, "--threshold");
+		int regressions = bench::compareFiles(std::cout, args[1], args[2],
+											  threshold.empty() ? 0.02 : std::stod(threshold) / 100.0);
+		return regressions > 0 ? 2 : 0;
 	}
 	catch (const std::exception &e)
 	{
 		std::cout << "Error: " << e.what() << std::endl;
+		return 1;
 	}
+}
 
-	return 0;
+// --self-test [NAME...]
+static int runSelfTest(const std::vector<std::string> &args)
+{
+	std::vector<std::string> names(args.begin() + 1, args.end());
+	return selftest::run(std::cout, names) == 0 ? 0 : 1;
 }
+
+int main(int argc, char *argv[])
+{
+	if (argc == 2 && std::string(argv[1]) == "--quick")
+	{
+		return runQuickStart();
+	}
+
+	std::vector<std::string> args(argv + 1, argv + argc);
+	if (hasFlag(args, "--quick"))
+	{
+		// Every other option needs a subsystem --quick leaves out.
+		std::cout << "Error: --quick cannot be combined with other options" << std::endl;
+		return 1;
+	}
+
+#ifdef __linux__
+	if (!args.empty() && (args[0] == "--shm-server" || args[0] == "--shm-client"))
+	{
+		return runShm(args);
+	}
+	if (!args.empty() && args[0] == "--shard")
+	{
+		return runShards(args);
+	}
+	if (!args.empty() && args[0] == "--bench-startup")
+	{
+		return runBenchStartup(args);
+	}
+	if (!args.empty() && args[0] == "--bench-shm")
+	{
+		return runBenchShm(args);
+	}
+#endif
+	if (!args.empty() && args[0] == "--bench")
+	{
+		return runBench(args);
+	}
+	if (!args.empty() && args[0] == "--bench-memory")
+	{
+		return runBenchMemory(args);
+	}
+	if (!args.empty() && args[0] == "--bench-compare")
+	{
+		return runBenchCompare(args);
+	}
+	if (!args.empty() && args[0] == "--self-test")
+	{
+		return runSelfTest(args);
+	}
+
+	bool showStats = hasFlag(args, "--stats");
+	bool checkOnly = hasFlag(args, "--check");
+	bool onePass = hasFlag(args, "--one-pass");
+	bool compiled = hasFlag(args, "--compile");
+	bool batch = hasFlag(args, "--batch");
+	bool canonicalOnly = hasFlag(args, "--canonical");
+	std::string traceFile = optionValue(args, "--trace");
+	std::string sourceFile = optionValue(args, "--file");
+	std::string profileFile = optionValue(args, "--profile");
+	if (!profileFile.empty())
+	{
+		profile::enable();
+	}
+	if (showStats)
+	{
+		stats::enable();
+	}
+	if (!traceFile.empty())
+	{
+		trace::enable();
+	}
+
+	bool trackAllocations = hasFlag(args, "--alloc");
+	if (trackAllocations)
+	{
+		alloc::enable();
+	}
+
+	bool measurePerf = hasFlag(args, "--perf");
+	PerfCounters perf(measurePerf);
+	if (measurePerf)
+	{
+		if (!perf.available())
+		{
+			std::cerr << "Hardware counters unavailable: " << perf.unavailableReason() << std::endl;
+		}
+	}
+
+	int status = 0;
+	try
+	{
+		std::string text;
+		bool program = !sourceFile.empty();
+		if (program)
+		{
+			std::ifstream file(sourceFile);
+			if (!file)
+			{
+				throw std::runtime_error("Cannot read " + sourceFile);
+			}
+			std::stringstream contents;
+			contents << file.rdbuf();
+			text = contents.str();
+		}
+		else if (batch)
+		{
+			std::stringstream contents;
+			contents << std::cin.rdbuf();
+			text = contents.str();
+		}
+		else
+		{
+			std::cout << "Enter expression: ";
+			std::getline(std::cin, text);
+		}
+
+		if (batch)
+		{
+			// One program per line, compiled together and run one by one.
+			std::vector<uint32_t> offsets{0};
+			for (size_t i = 0; i < text.size(); i++)
+			{
+				if (text[i] == '\n')
+				{
+					offsets.push_back(static_cast<uint32_t>(i + 1));
+				}
+			}
+			if (offsets.back() != text.size())
+			{
+				offsets.push_back(static_cast<uint32_t>(text.size()));
+			}
+
+			VirtualMachine machine;
+			std::vector<EvalOutcome> outcomes;
+			std::string fetchFile = optionValue(args, "--fetch");
+			if (!fetchFile.empty())
+			{
+				// Lines run interleaved; variables missing from the store
+				// are fetched from FILE (name=value lines) in batches.
+				std::ifstream file(fetchFile);
+				if (!file)
+				{
+					throw std::runtime_error("Cannot read " + fetchFile);
+				}
+				LocalKeyValueStore store;
+				store.load(file);
+				AsyncEvaluator evaluator(store);
+				for (size_t i = 0; i + 1 < offsets.size(); i++)
+				{
+					evaluator.submit(text.substr(offsets[i], offsets[i + 1] - offsets[i]));
+				}
+				outcomes = evaluator.run();
+				std::cerr << "Fetched variables in " << evaluator.fetchBatches() << " batches" << std::endl;
+			}
+			else if (hasFlag(args, "--cached"))
+			{
+				// Each line on its own, with equivalent lines sharing code.
+				CompileCache cache;
+				outcomes.resize(offsets.size() - 1);
+				for (size_t i = 0; i + 1 < offsets.size(); i++)
+				{
+					EvalOutcome &outcome = outcomes[i];
+					try
+					{
+						auto code = cache.compile(text.substr(offsets[i], offsets[i + 1] - offsets[i]));
+						outcome.value = machine.run(*code);
+						outcome.ok = true;
+					}
+					catch (const std::exception &e)
+					{
+						outcome.error = e.what();
+					}
+				}
+				const CompileCache::Counts &counts = cache.counts();
+				std::cerr << "Compile cache: " << counts.textHits << " text hits, " << counts.canonicalHits
+						  << " canonical hits, " << counts.misses << " compiled" << std::endl;
+			}
+			else
+			{
+				CompiledBatch programs;
+				programs.compile(text, offsets);
+				programs.runAll(machine, outcomes);
+			}
+			for (const EvalOutcome &outcome : outcomes)
+			{
+				if (outcome.ok)
+					std::cout << "Result: " << outcome.value << "\n";
+				else
+					std::cout << "Error: " << outcome.error << "\n";
+			}
+		}
+		else if (canonicalOnly)
+		{
+			// Prints each statement's canonical form and stable hash.
+			Parser parser(text);
+			ExpressionPool pool;
+			auto statements = program ? parser.parseProgram()
+									  : std::vector<std::shared_ptr<ASTNode>>{parser.parse()};
+			for (const auto &statement : statements)
+			{
+				auto node = pool.intern(statement);
+				std::cout << "Canonical: " << pool.text(node.get()) << "\n"
+						  << "Hash: " << std::hex << std::setw(16) << std::setfill('0')
+						  << pool.hash(node.get()) << std::dec << std::setfill(' ') << std::endl;
+			}
+		}
+		else if (checkOnly)
+		{
+			// A single line is one statement, as when evaluating it.
+			Recognizer recognizer(hasFlag(args, "--all-errors"));
+			if (program ? recognizer.recognize(text) : recognizer.recognizeStatement(text))
+			{
+				std::cout << "Valid" << std::endl;
+			}
+			for (size_t i = 0; i < recognizer.storedErrors(); i++)
+			{
+				std::cout << "Error: " << recognizer.describe(i) << std::endl;
+			}
+			if (recognizer.errorCount() > recognizer.storedErrors())
+			{
+				std::cout << "... " << recognizer.errorCount() - recognizer.storedErrors() << " more errors" << std::endl;
+			}
+			status = recognizer.errorCount() == 0 ? 0 : 1;
+		}
+		else
+		{
+			// The parser pulls tokens on demand, so lexing is measured as a
+			// separate standalone pass over the same input, timed as a whole.
+			uint64_t units[stats::phaseCount] = {};
+			if (perf.available() || stats::enabled() || trace::enabled())
+			{
+				PerfCounters::Sample start = perf.read();
+				{
+					stats::PhaseScope timer(stats::LEX);
+					alloc::PhaseScope allocations(stats::LEX);
+					trace::Span span("lex");
+					Lexer lexer(text);
+					while (lexer.nextToken().type != TokenType::END)
+					{
+						units[stats::LEX]++;
+					}
+					span.arg("tokens", static_cast<int64_t>(units[stats::LEX]));
+				}
+				perf.record(stats::LEX, start);
+				units[stats::PARSE] = units[stats::LEX];
+			}
+
+			// Every evaluated node is charged to the active budget anyway, so
+			// an unlimited one counts them without turning on statistics.
+			int result = 0;
+			EvalBudget evaluated(EvalBudget::unlimited);
+			EvalBudget::Scope counting(evaluated);
+			if (onePass)
+			{
+				PerfCounters::Sample start = perf.read();
+				OnePassEvaluator evaluator(text);
+				result = program ? evaluator.evaluateProgram() : evaluator.evaluate();
+				perf.record(stats::EVALUATE, start);
+			}
+			else if (compiled)
+			{
+				PerfCounters::Sample start = perf.read();
+				Compiler compiler(text);
+				Bytecode code;
+				if (program)
+				{
+					code = compiler.compileProgram();
+				}
+				else
+				{
+					compiler.compile(code);
+				}
+				perf.record(stats::COMPILE, start);
+				units[stats::COMPILE] = code.size();
+
+				start = perf.read();
+				VirtualMachine machine;
+				result = machine.run(code);
+				perf.record(stats::EVALUATE, start);
+			}
+			else if (program)
+			{
+				trace::Span span("program");
+				PerfCounters::Sample start = perf.read();
+				Parser parser(text);
+				auto statements = parser.parseProgram();
+				perf.record(stats::PARSE, start);
+
+				start = perf.read();
+				for (size_t i = 0; i < statements.size(); i++)
+				{
+					trace::Span statementSpan("statement");
+					statementSpan.arg("index", static_cast<int64_t>(i));
+					result = parser.evaluate(statements[i]);
+				}
+				perf.record(stats::EVALUATE, start);
+			}
+			else
+			{
+				PerfCounters::Sample start = perf.read();
+				Parser parser(text);
+				auto ast = parser.parse();
+				perf.record(stats::PARSE, start);
+
+				start = perf.read();
+				result = parser.evaluate(ast);
+				perf.record(stats::EVALUATE, start);
+			}
+			units[stats::EVALUATE] = evaluated.nodesUsed();
+
+			std::cout << "Result: " << result << std::endl;
+			if (perf.available())
+			{
+				perf.report(std::cerr, units);
+			}
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	if (showStats)
+	{
+		stats::report(std::cerr);
+	}
+	if (trackAllocations)
+	{
+		alloc::report(std::cerr);
+	}
+	if (!traceFile.empty() && !trace::write(traceFile))
+	{
+		std::cerr << "Cannot write trace to " << traceFile << std::endl;
+	}
+	if (!profileFile.empty())
+	{
+		std::ofstream folded(profileFile, std::ios::trunc);
+		profile::writeFolded(folded);
+		profile::report(std::cerr);
+	}
+
+	return status;
+}
\ No newline at end of file